@@ -1,4 +1,5 @@
 #include "BinaryImplementation.h"
+#include <opencv2/core/hal/intrin.hpp>
 
 BinaryImplementation::BinaryImplementation(int newNumberColumns): slImplementation(string("BinaryImplementation")), numberColumns(newNumberColumns) {
         Black_Value = 0;
@@ -13,13 +14,19 @@ void BinaryImplementation::preExperimentRun() {
 
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 
-	int arraySize = cameraResolution.width * cameraResolution.height;
+	wordsPerRow = (cameraResolution.width + 63) / 64;
 
-	binaryCode = new int[arraySize];
+	// The pattern planes, then the invalid plane
+	int arraySize = (getNumberPatterns() + 1) * cameraResolution.height * wordsPerRow;
+
+	bitPlanes = new uint64_t[arraySize];
+	invalidPlane = bitPlanes + (getNumberPatterns() * cameraResolution.height * wordsPerRow);
 
 	for (int index = 0; index < arraySize; index++) {
-		binaryCode[index] = 0;
+		bitPlanes[index] = 0;
 	}
+
+	codeCameraX = new int[cameraResolution.height * numberColumns];
 }
 
 // For binary implementations, the "width" of the pattern
@@ -30,22 +37,84 @@ double BinaryImplementation::getPatternWidth() {
 
 
 double BinaryImplementation::getBinaryCode(int xProjector, int y) {
+	if (xProjector < 0 || xProjector >= (int)numberColumns) {
+		return -1;
+	}
+
+	return (double)codeCameraX[(y * numberColumns) + xProjector];
+}
+
+// The index of the lowest set bit of a non zero word
+static inline int lowestSetBit(uint64_t word) {
+	return __builtin_ctzll(word);
+}
+
+// Decode every camera pixel once, keeping the first camera column
+// of each projector column in each row, so getBinaryCode is a lookup.
+// The bit planes are read a word (64 pixels) at a time, skipping
+// words with no valid pixels and only visiting the set bits.
+void BinaryImplementation::postIterationsProcess() {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
-//	return this->binaryCode[(y * cameraResolution.width) + xProjector];
 
-	for (int x = 0; x < cameraResolution.width; x++) {
-		int binaryXProjector = binaryCode[(y * cameraResolution.width) + x];
+	int numberPatterns = getNumberPatterns();
+	int planeSize = cameraResolution.height * wordsPerRow;
+	int wordCodes[64];
+
+	// The bits of the last word of a row that are within the row
+	int lastWordBits = cameraResolution.width - ((wordsPerRow - 1) * 64);
+	uint64_t lastWordMask = lastWordBits >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << lastWordBits) - 1);
+
+	for (int y = 0; y < cameraResolution.height; y++) {
+		int *rowCodeCameraX = codeCameraX + (y * numberColumns);
 
-		if (binaryXProjector == xProjector) {
-			return (double)x;
+		for (unsigned int xProjector = 0; xProjector < numberColumns; xProjector++) {
+			rowCodeCameraX[xProjector] = -1;
+		}
+
+		for (int word = 0; word < wordsPerRow; word++) {
+			int wordOffset = (y * wordsPerRow) + word;
+			uint64_t validBits = ~invalidPlane[wordOffset];
+
+			if (word == wordsPerRow - 1) {
+				validBits &= lastWordMask;
+			}
+
+			if (validBits == 0) {
+				continue;
+			}
+
+			// Gather the codes of the 64 pixels from the planes, the first pair is the most significant bit
+			for (int bit = 0; bit < 64; bit++) {
+				wordCodes[bit] = 0;
+			}
+
+			for (int patternIndex = 0; patternIndex < numberPatterns; patternIndex++) {
+				uint64_t setBits = bitPlanes[(patternIndex * planeSize) + wordOffset] & validBits;
+				int codeBit = 1 << (numberPatterns - 1 - patternIndex);
+
+				for (; setBits != 0; setBits &= setBits - 1) {
+					wordCodes[lowestSetBit(setBits)] |= codeBit;
+				}
+			}
+
+			for (; validBits != 0; validBits &= validBits - 1) {
+				int bit = lowestSetBit(validBits);
+				int xProjector = decodeCode(wordCodes[bit]);
+
+				if (xProjector >= 0 && xProjector < (int)numberColumns && rowCodeCameraX[xProjector] == -1) {
+					rowCodeCameraX[xProjector] = (word * 64) + bit;
+				}
+			}
 		}
 	}
 
-	return -1;
+	slImplementation::postIterationsProcess();
 }
 
 void BinaryImplementation::postExperimentRun() {
-	delete[] binaryCode;
+	delete[] bitPlanes;
+	delete[] codeCameraX;
+	positiveColourTotals.release();
 }
 
 int BinaryImplementation::getNumberPatterns() {
@@ -116,38 +185,141 @@ Mat BinaryImplementation::generatePattern() {
 	return pattern;
 }
 
-void BinaryImplementation::processCapture(Mat captureMat) {
-	experiment->storeCapture(captureMat);
+#if CV_SIMD128
+// Sums the colour channels of 16 BGR pixels, widened to 16 bits so totals up to 765 fit
+static inline void v_sumColourChannels(const uchar *pixels, v_uint16x8 &totalsLow, v_uint16x8 &totalsHigh) {
+	v_uint8x16 blue, green, red;
+	v_load_deinterleave(pixels, blue, green, red);
 
-	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+	v_uint16x8 blueLow, blueHigh, greenLow, greenHigh, redLow, redHigh;
+	v_expand(blue, blueLow, blueHigh);
+	v_expand(green, greenLow, greenHigh);
+	v_expand(red, redLow, redHigh);
 
-	if (experiment->getIterationIndex() % 2 != 0) {
-		Mat positiveMat = experiment->getCaptureAt(experiment->getNumberCaptures() - 2);
-		Mat negativeMat = experiment->getLastCapture();
+	totalsLow = blueLow + greenLow + redLow;
+	totalsHigh = blueHigh + greenHigh + redHigh;
+}
+#endif
 
-		for (int y = 0; y < cameraResolution.height; y++) {
-			for (int x = 0; x < cameraResolution.width; x++) {
-				
-				Vec3b positivePixelBGR = positiveMat.at<Vec3b>(y, x);
-				Vec3b negativePixelBGR = negativeMat.at<Vec3b>(y, x);
+// Sums the colour channels of rows of the positive capture, for use with parallel_for_
+class BinaryColourTotaller : public ParallelLoopBody {
+	public:
+		BinaryColourTotaller(const Mat &newCaptureMat, Mat &newColourTotals): captureMat(newCaptureMat), colourTotals(newColourTotals) {};
 
-				int positiveColourTotal = (int)positivePixelBGR[0] + (int)positivePixelBGR[1] + (int)positivePixelBGR[2];
-				int negativeColourTotal = (int)negativePixelBGR[0] + (int)negativePixelBGR[1] + (int)negativePixelBGR[2];
+		void operator()(const Range &rowRange) const {
+			int width = captureMat.cols;
 
-				int colourDifference = guessColour(positiveColourTotal - negativeColourTotal);
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				const uchar *captureRow = captureMat.ptr<uchar>(y);
+				ushort *colourTotalsRow = colourTotals.ptr<ushort>(y);
 
-				int arrayOffset = (y * cameraResolution.width) + x;
+				int x = 0;
+#if CV_SIMD128
+				for (; x <= width - 16; x += 16) {
+					v_uint16x8 totalsLow, totalsHigh;
+					v_sumColourChannels(captureRow + (x * 3), totalsLow, totalsHigh);
 
-				int before = binaryCode[arrayOffset];
+					v_store(colourTotalsRow + x, totalsLow);
+					v_store(colourTotalsRow + x + 8, totalsHigh);
+				}
+#endif
+				for (; x < width; x++) {
+					colourTotalsRow[x] = (ushort)(captureRow[(x * 3)] + captureRow[(x * 3) + 1] + captureRow[(x * 3) + 2]);
+				}
+			}
+		}
 
-				if (binaryCode[arrayOffset] != -1) {
-					binaryCode[arrayOffset] <<= 1;
-				
-					if(colourDifference == -1) binaryCode[arrayOffset] = -1;
-					else binaryCode[arrayOffset] += colourDifference;
+	private:
+		const Mat &captureMat;
+		Mat &colourTotals;
+};
+
+// Compares rows of the negative capture with the positive colour totals
+// and sets the bits of the pair's plane and the invalid plane a word at
+// a time, for use with parallel_for_. Rows start on a new word, so rows
+// never share a word.
+class BinaryPairComparer : public ParallelLoopBody {
+	public:
+		BinaryPairComparer(const Mat &newPositiveColourTotals, const Mat &newNegativeMat, uint64_t *newBitPlane, uint64_t *newInvalidPlane, int newWordsPerRow, short newBlackThreshold, short newWhiteThreshold):
+			positiveColourTotals(newPositiveColourTotals), negativeMat(newNegativeMat), bitPlane(newBitPlane), invalidPlane(newInvalidPlane), wordsPerRow(newWordsPerRow), blackThreshold(newBlackThreshold), whiteThreshold(newWhiteThreshold) {};
+
+		void operator()(const Range &rowRange) const {
+			int width = negativeMat.cols;
+#if CV_SIMD128
+			v_int16x8 blackThresholds = v_setall_s16(blackThreshold);
+			v_int16x8 whiteThresholds = v_setall_s16(whiteThreshold);
+#endif
+
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				const ushort *positiveTotalsRow = positiveColourTotals.ptr<ushort>(y);
+				const uchar *negativeRow = negativeMat.ptr<uchar>(y);
+				uint64_t *bitPlaneRow = bitPlane + (y * wordsPerRow);
+				uint64_t *invalidPlaneRow = invalidPlane + (y * wordsPerRow);
+
+				for (int word = 0; word < wordsPerRow; word++) {
+					const ushort *wordPositiveTotals = positiveTotalsRow + (word * 64);
+					const uchar *wordNegative = negativeRow + (word * 64 * 3);
+					int wordWidth = min(64, width - (word * 64));
+
+					// The same decisions as guessColour, 1 below the black threshold, 0 above the white threshold, otherwise invalid
+					uint64_t oneBits = 0;
+					uint64_t zeroBits = 0;
+					int bit = 0;
+#if CV_SIMD128
+					// 16 pixels at a time, the comparison masks packed into bits with v_signmask. Totals are at most 765, so the differences fit in 16 bits
+					for (; bit <= wordWidth - 16; bit += 16) {
+						v_uint16x8 negativeTotalsLow, negativeTotalsHigh;
+						v_sumColourChannels(wordNegative + (bit * 3), negativeTotalsLow, negativeTotalsHigh);
+
+						v_int16x8 differencesLow = v_reinterpret_as_s16(v_load(wordPositiveTotals + bit)) - v_reinterpret_as_s16(negativeTotalsLow);
+						v_int16x8 differencesHigh = v_reinterpret_as_s16(v_load(wordPositiveTotals + bit + 8)) - v_reinterpret_as_s16(negativeTotalsHigh);
+
+						oneBits |= (uint64_t)(v_signmask(differencesLow < blackThresholds) | (v_signmask(differencesHigh < blackThresholds) << 8)) << bit;
+						zeroBits |= (uint64_t)(v_signmask(differencesLow > whiteThresholds) | (v_signmask(differencesHigh > whiteThresholds) << 8)) << bit;
+					}
+#endif
+					for (; bit < wordWidth; bit++) {
+						int difference = (int)wordPositiveTotals[bit] - (wordNegative[(bit * 3)] + wordNegative[(bit * 3) + 1] + wordNegative[(bit * 3) + 2]);
+
+						oneBits |= (uint64_t)(difference < blackThreshold) << bit;
+						zeroBits |= (uint64_t)(difference > whiteThreshold) << bit;
+					}
+
+					uint64_t wordMask = wordWidth == 64 ? ~(uint64_t)0 : (((uint64_t)1 << wordWidth) - 1);
+
+					bitPlaneRow[word] |= oneBits;
+					invalidPlaneRow[word] |= ~(oneBits | zeroBits) & wordMask;
 				}
 			}
-		}	
+		}
+
+	private:
+		const Mat &positiveColourTotals;
+		const Mat &negativeMat;
+		uint64_t *bitPlane;
+		uint64_t *invalidPlane;
+		int wordsPerRow;
+		short blackThreshold;
+		short whiteThreshold;
+};
+
+void BinaryImplementation::processCapture(Mat captureMat) {
+	experiment->storeCapture(captureMat);
+
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int iterationIndex = experiment->getIterationIndex();
+
+	if (iterationIndex % 2 == 0) {
+		// Only the colour totals of the positive capture are needed to compare with the negative capture
+		positiveColourTotals.create(cameraResolution.height, cameraResolution.width, CV_16UC1);
+
+		parallel_for_(Range(0, cameraResolution.height), BinaryColourTotaller(captureMat, positiveColourTotals));
+	} else {
+		int planeSize = cameraResolution.height * wordsPerRow;
+		uint64_t *bitPlane = bitPlanes + ((iterationIndex / 2) * planeSize);
+
+		parallel_for_(Range(0, cameraResolution.height), BinaryPairComparer(positiveColourTotals, captureMat, bitPlane, invalidPlane, wordsPerRow, Black_Threshold, White_Threshold));
 	}
 }
 
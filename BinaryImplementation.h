@@ -17,8 +17,14 @@ class BinaryImplementation : public slImplementation {
 		bool hasMoreIterations();
 		virtual Mat generatePattern();
 		virtual void processCapture(Mat);
+		// Builds the per-row lookup of codeCameraX before solving the correspondences
+		virtual void postIterationsProcess();
+		// The positive capture of the current pair is kept as its colour totals, not as a capture
+		virtual int getNumberCapturesRetained() {return 0;}
 		//Getters and Setters
 		virtual double getBinaryCode(int, int);
+		// Converts a captured code into the projector column it identifies
+		virtual int decodeCode(int code) {return code;}
 		int getNumberPatterns();
 
                 // The next function determine whether a colour can be
@@ -46,8 +52,18 @@ class BinaryImplementation : public slImplementation {
 		// The thresholds for black and white values
 		short Black_Threshold;
 		short White_Threshold;
-		// An array containing the codes for each column
-		int *binaryCode;
+		// The number of 64 bit words holding a camera row of a bit plane
+		int wordsPerRow;
+		// One packed bit plane (64 camera pixels per word, rows starting
+		// on a new word) per positive/negative pair, where a set bit is a 1
+		// in the code, followed by the plane of pixels whose code is invalid
+		uint64_t *bitPlanes;
+		uint64_t *invalidPlane;
+		// The colour total (B + G + R) of each pixel of the positive capture of the current pair
+		Mat positiveColourTotals;
+		// An array containing, for each camera row, the first camera
+		// column at which each projector column was decoded (or -1)
+		int *codeCameraX;
 };
 
 #endif //BINARY_IMPLEMENTATION_H
@@ -1,17 +1,52 @@
 #include "DeBruijnImplementation.h"
 
-DeBruijnImplementation::DeBruijnImplementation(unsigned int newNumColumns): slImplementation(string("DeBruijnImplementation")),numberEdges(newNumColumns - 1) {
+// The sequences generated so far, by alphabet size and window size
+static map<pair<int, int>, vector<int> > sequenceCache;
+static mutex sequenceCacheMutex;
+
+DeBruijnImplementation::DeBruijnImplementation(unsigned int newNumColumns, int newK, int newN): slImplementation(string("DeBruijnImplementation")),numberEdges(newNumColumns - 1),k(newK),n(newN),numberRowRanges(DEBRUIJN_DEFAULT_ROW_RANGES),decodeMode(DEBRUIJN_DECODE_ALIGNMENT) {
+	if (k < 2 || k > DEBRUIJN_MAX_K) {
+		FATAL("DeBruijnImplementation k must be from 2 to " << DEBRUIJN_MAX_K << ", not " << k)
+	}
+
+	if (n < 1 || n > DEBRUIJN_MAX_N) {
+		FATAL("DeBruijnImplementation n must be from 1 to " << DEBRUIJN_MAX_N << ", not " << n)
+	}
+
+	// The whole sequence is generated and cached, so keep it to a sane size
+	long sequenceLength = 1;
+
+	for (int w = 0; w < n && sequenceLength <= DEBRUIJN_MAX_SEQUENCE_LENGTH; w++) {
+		sequenceLength *= k;
+	}
+
+	if (sequenceLength > DEBRUIJN_MAX_SEQUENCE_LENGTH) {
+		FATAL("DeBruijnImplementation k^n must be at most " << DEBRUIJN_MAX_SEQUENCE_LENGTH << ", not " << k << "^" << n)
+	}
+
+	// Scoring only ever needs these values, so compute them once
+	for (int qc = -1; qc <= 1; qc++) {
+		for (int ec = -255; ec <= 255; ec++) {
+			consistencyTable[qc + 1][ec + 255] = consistency(qc, ec);
+		}
+	}
 }
 
 void DeBruijnImplementation::preExperimentRun() {
 //	Vec3s transition(1,0,0), difference(85,80,80);
 //	DB("score: " << score(transition, difference))	
 
+	columnColours = new int[getNumberColumns()];
 	transitions = new Vec3s[getNumberEdges()];
+	transitionSymbols = new int[getNumberEdges()];
+
+	buildTransitions();
 }
 
 void DeBruijnImplementation::postExperimentRun() {
+	delete[] columnColours;
 	delete[] transitions;
+	delete[] transitionSymbols;
 }
 
 // For these implementations, the "width" of the pattern
@@ -31,6 +66,22 @@ unsigned int DeBruijnImplementation::getNumberEdges() {
     return this->numberEdges;
 }
 
+int DeBruijnImplementation::getK() {
+	return k;
+}
+
+int DeBruijnImplementation::getN() {
+	return n;
+}
+
+void DeBruijnImplementation::setNumberRowRanges(int newNumberRowRanges) {
+	numberRowRanges = newNumberRowRanges;
+}
+
+void DeBruijnImplementation::setDecodeMode(DeBruijnDecodeMode newDecodeMode) {
+	decodeMode = newDecodeMode;
+}
+
 Mat DeBruijnImplementation::generatePattern() {
 	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
 
@@ -39,46 +90,18 @@ Mat DeBruijnImplementation::generatePattern() {
 
 	float columnWidth = (float)screenWidth / getNumberColumns();
 
-//	DB("columnWidth: " << columnWidth)
-
-	int size = DEBRUIJN_K * DEBRUIJN_N;
-	vector<int> a(size), sequence;
-
-	fill(a.begin(), a.end(), 0);
-	db(1, 1, DEBRUIJN_K, DEBRUIJN_N, a, sequence);
-
 	Mat pattern(screenHeight, screenWidth, CV_8UC3, Scalar(0, 0, 0));
 
 	float columnX = 0;
-	int pj = 1;
 
 	for (int columnIndex = 0; columnIndex < getNumberColumns(); columnIndex++) {
-		int dj = sequence[columnIndex] + 1;
-
-		int pjInit = pj;
-		Vec3s pInit(0,0,0);
-
-		for(int c=0;c<3;c++){
-			if (pjInit & (1 << c)) {
-				pInit[c] = 255;
-			}
-		}
-
-		if (columnIndex > 0) {
-			pj = pj ^ dj;
-		}
-
 		Vec3s point(0,0,0);
 		for(int c=0;c<3;c++) {
-			if (pj & (1 << c)) {
+			if (columnColours[columnIndex] & (1 << c)) {
 				point[c] = 255;
 			}
 		}
 
-		if (columnIndex > 0) {
-			transitions[columnIndex-1] = (point-pInit)/255;
-		}
-
 		rectangle(pattern, Point(columnX, 0), Point(columnX + columnWidth, screenHeight), point, FILLED);
 		columnX += columnWidth;
 	}
@@ -86,104 +109,362 @@ Mat DeBruijnImplementation::generatePattern() {
 	return pattern;
 }
 
+// Each column's colour is the previous column's colour xor'ed with the
+// next sequence value plus 1, so neighbouring columns always differ. The
+// sequence repeats if there are more columns than it has values.
+void DeBruijnImplementation::buildTransitions() {
+	const vector<int> &sequence = getSequence(k, n);
+	int colour = 1;
+
+	for (int columnIndex = 0; columnIndex < getNumberColumns(); columnIndex++) {
+		int previousColour = colour;
+
+		if (columnIndex > 0) {
+			colour = colour ^ (sequence[columnIndex % sequence.size()] + 1);
+		}
+
+		columnColours[columnIndex] = colour;
+
+		if (columnIndex > 0) {
+			for (int c = 0; c < 3; c++) {
+				transitions[columnIndex - 1][c] = ((colour >> c) & 1) - ((previousColour >> c) & 1);
+			}
+
+			transitionSymbols[columnIndex - 1] = getTransitionSymbol(transitions[columnIndex - 1]);
+		}
+	}
+
+	buildWindowTransitions();
+}
+
 void DeBruijnImplementation::processCapture(Mat captureMat) {
 	experiment->storeCapture(captureMat);
 }
 
+// Decodes a range of capture rows with its own arena, for use with
+// parallel_for_. Each row's results are stored on their own with
+// storeResults, which experiments support calling concurrently for
+// different rows.
+class DeBruijnRowDecoder : public ParallelLoopBody {
+	public:
+		DeBruijnRowDecoder(DeBruijnImplementation *newImplementation, const Mat &newCaptureMat): implementation(newImplementation), captureMat(newCaptureMat) {};
+
+		void operator()(const Range &rowRange) const {
+			DeBruijnDecodeArena arena;
+			arena.resize(captureMat.cols, implementation->getNumberEdges());
+
+			vector<slDepthExperimentResult> results;
+			results.reserve(captureMat.cols);
+
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				implementation->decodeRow(y, captureMat, arena, results);
+				implementation->experiment->storeResults(results);
+			}
+		}
+
+	private:
+		DeBruijnImplementation *implementation;
+		const Mat &captureMat;
+};
+
 void DeBruijnImplementation::postIterationsProcess() {
-	slInfrastructure *infrastructure = experiment->getInfrastructure();
-	Size cameraResolution = infrastructure->getCameraResolution();
-	Size projectorResolution = infrastructure->getProjectorResolution();
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 	Mat captureMat = experiment->getLastCapture();
 
-	float columnWidth = (float)cameraResolution.width / (float)getNumberColumns();
+	// Each range has its own arena, and by default there is one per OpenCV thread
+	int numberRanges = numberRowRanges > 0 ? numberRowRanges : getNumThreads();
+
+	parallel_for_(Range(0, cameraResolution.height), DeBruijnRowDecoder(this, captureMat), numberRanges);
+}
+
+void DeBruijnDecodeArena::resize(int width, int numberTransitions) {
+	// A row has at most width - 2 edges
+	int maxEdges = max(width - 2, 0);
+	int maxCorrespondences = min(maxEdges, numberTransitions);
+
+	differences.resize(width);
+	gradients.resize(width);
+	edges.resize(maxEdges);
+	edgeXs.resize(maxEdges);
+	edgeScores.resize((size_t)maxEdges * DEBRUIJN_NUMBER_SYMBOLS);
+	edgeSymbols.resize(maxEdges);
+	edgeWindowTransitions.resize(maxEdges);
+	previousScores.resize(numberTransitions);
+	currentScores.resize(numberTransitions);
+	cases.resize((size_t)maxEdges * numberTransitions);
+	correspondenceEdges.resize(maxCorrespondences);
+	correspondenceTransitions.resize(maxCorrespondences);
+}
+
+void DeBruijnImplementation::decodeRow(int y, const Mat &captureMat, DeBruijnDecodeArena &arena, vector<slDepthExperimentResult> &results) {
+	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
+	int width = captureMat.cols;
+
+	results.clear();
+
+	const Vec3b *captureRow = captureMat.ptr<Vec3b>(y);
+	Vec3s prevCapturelBGR(0,0,0);
 
-	for (int y = 0; y < cameraResolution.height; y++) {
-		int prevR = 0;
-		int prevG = 0;
-		int prevB = 0;
-		Vec3s prevCapturelBGR(0,0,0);
+	for (int x = 0; x < width; x++) {
+		Vec3s capturelBGR = captureRow[x]; /* Stored in signed ints to be able to take the difference */
+		Vec3s difference = capturelBGR - prevCapturelBGR;
 
-		int rgbWidth = cameraResolution.width * 3;
+		arena.differences[x] = difference;
+		arena.gradients[x] = (difference[0] * difference[0]) + (difference[1] * difference[1]) + (difference[2] * difference[2]);
+		prevCapturelBGR = capturelBGR;
+	}
 
-		int gradients[cameraResolution.width];
-		int correspondence[cameraResolution.width];
-		/*int differences[rgbWidth];*/
-		Vec3s *differences = new Vec3s[rgbWidth];
-		Vec3s *edges = new Vec3s[rgbWidth];
+	int numberEdgesFound = 0;
 
-		for (int x = 0; x < cameraResolution.width; x++) {
-			Vec3s capturelBGR = captureMat.at<Vec3b>(y, x); /* Stored in signed ints to be able to take the difference */
-			
-			differences[x] = capturelBGR - prevCapturelBGR;
-			gradients[x] = norm(differences[x],NORM_L2SQR) ;
-			prevCapturelBGR = capturelBGR;
+	for (int x = 1; x < (width - 1); x++) {
+		if (
+			(arena.gradients[x - 1] + DEBRUIJN_THRESHOLD) < arena.gradients[x] && 
+			(arena.gradients[x + 1] + DEBRUIJN_THRESHOLD) < arena.gradients[x]
+		) {
+			arena.edges[numberEdgesFound] = arena.differences[x];
+			arena.edgeXs[numberEdgesFound] = x;
+			numberEdgesFound++;
 		}
+	}
+
+	if (numberEdgesFound == 0 || getNumberEdges() == 0) {
+		return;
+	}
+
+	scoreEdges(numberEdgesFound, arena);
+
+	int nCorrespondences;
+
+	if (decodeMode == DEBRUIJN_DECODE_WINDOW_HASH) {
+		nCorrespondences = decodeWindows(numberEdgesFound, arena);
+	} else {
+		nCorrespondences = alignEdges(0, numberEdgesFound, 0, getNumberEdges(), arena, 0);
+	}
+
+	for (int i = 0; i < nCorrespondences; i++) {
+		int x = arena.edgeXs[arena.correspondenceEdges[i]];
+		int xPos = arena.correspondenceTransitions[i] + 1;
+
+		double displacement = experiment->getDisplacement(xPos, x);
+		results.push_back(slDepthExperimentResult((int)(experiment->getImplementation()->getPatternXOffsetFactor(xPos) * projectorResolution.width), y, displacement));
+	}
+}
+
+// An edge only ever scores against the 27 possible transitions, so score those once per edge
+void DeBruijnImplementation::scoreEdges(int numberEdgesFound, DeBruijnDecodeArena &arena) {
+	for (int i = 0; i < numberEdgesFound; i++) {
+		double *edgeScores = &arena.edgeScores[(size_t)i * DEBRUIJN_NUMBER_SYMBOLS];
+		const double *consistencyR = &consistencyTable[0][arena.edges[i][0] + 255];
+		const double *consistencyG = &consistencyTable[0][arena.edges[i][1] + 255];
+		const double *consistencyB = &consistencyTable[0][arena.edges[i][2] + 255];
 
-		int edgeIndex = 0;
+		for (int symbol = 0; symbol < DEBRUIJN_NUMBER_SYMBOLS; symbol++) {
+			double sr = consistencyR[(symbol / 9) * DEBRUIJN_NUMBER_DIFFERENCES];
+			double sg = consistencyG[((symbol / 3) % 3) * DEBRUIJN_NUMBER_DIFFERENCES];
+			double sb = consistencyB[(symbol % 3) * DEBRUIJN_NUMBER_DIFFERENCES];
 
-		for (int x = 1;x < (cameraResolution.width - 1); x++) {
-			if (
-				(gradients[x - 1] + DEBRUIJN_THRESHOLD) < gradients[x] && 
-				(gradients[x + 1] + DEBRUIJN_THRESHOLD) < gradients[x]
-			) {
-				edges[edgeIndex] = differences[x];
-				correspondence[edgeIndex] = x;
-				edgeIndex++;
+			edgeScores[symbol] = min(sr, min(sg, sb));
+		}
+	}
+}
+
+// Bottom up alignment of the edges i with the pattern transitions j, where
+// the score of a cell is the best of matching (the score of i - 1, j - 1
+// plus the score of the pair), skipping the edge (i - 1, j) or skipping the
+// transition (i, j - 1), and cells outside the table score 0. Only two rows
+// of scores are kept, the chosen cases are walked back from the last cell.
+int DeBruijnImplementation::alignEdges(int firstEdge, int numberEdgesToAlign, int firstTransition, int numberTransitions, DeBruijnDecodeArena &arena, int nPreviousCorrespondences) {
+	double *previousScores = &arena.previousScores[0];
+	double *currentScores = &arena.currentScores[0];
+	const int *rowTransitionSymbols = transitionSymbols + firstTransition;
+
+	for (int i = 0; i < numberEdgesToAlign; i++) {
+		unsigned char *cases = &arena.cases[(size_t)i * numberTransitions];
+		const double *edgeScores = &arena.edgeScores[(size_t)(firstEdge + i) * DEBRUIJN_NUMBER_SYMBOLS];
+
+		for (int j = 0; j < numberTransitions; j++) {
+			double value1 = ((i > 0 && j > 0) ? previousScores[j - 1] : 0) + edgeScores[rowTransitionSymbols[j]];
+			double value2 = i > 0 ? previousScores[j] : 0;
+			double value3 = j > 0 ? currentScores[j - 1] : 0;
+
+			if (value1 > value2 && value1 > value3) {
+				cases[j] = DEBRUIJN_CASE_MATCH;
+				currentScores[j] = value1;
+			} else if (value2 > value3) {
+				cases[j] = DEBRUIJN_CASE_SKIP_EDGE;
+				currentScores[j] = value2;
+			} else {
+				cases[j] = DEBRUIJN_CASE_SKIP_TRANSITION;
+				currentScores[j] = value3;
+			}
+		}
+
+		swap(previousScores, currentScores);
+	}
+
+	// Walk back from the last cell, the matches are found last to first
+	int *correspondenceEdges = &arena.correspondenceEdges[nPreviousCorrespondences];
+	int *correspondenceTransitions = &arena.correspondenceTransitions[nPreviousCorrespondences];
+	int nCorrespondences = 0;
+	int i = numberEdgesToAlign - 1;
+	int j = numberTransitions - 1;
+
+	while (i >= 0 && j >= 0) {
+		switch (arena.cases[((size_t)i * numberTransitions) + j]) {
+			case DEBRUIJN_CASE_MATCH:
+				correspondenceEdges[nCorrespondences] = firstEdge + i;
+				correspondenceTransitions[nCorrespondences] = firstTransition + j;
+				nCorrespondences++;
+				i--;
+				j--;
+				break;
+			case DEBRUIJN_CASE_SKIP_EDGE:
+				i--;
+				break;
+			default:
+				j--;
+		}
+	}
+
+	reverse(correspondenceEdges, correspondenceEdges + nCorrespondences);
+	reverse(correspondenceTransitions, correspondenceTransitions + nCorrespondences);
+
+	return nCorrespondences;
+}
+
+// Every window of n consecutive transitions of a de Bruijn
+// pattern is (nearly always) unique, so a window of classified edges
+// identifies its transitions directly. Windows confirmed by an
+// overlapping window are taken as matches, in order, and only the runs
+// of edges and transitions between matches are aligned.
+int DeBruijnImplementation::decodeWindows(int numberEdgesFound, DeBruijnDecodeArena &arena) {
+	int numberTransitions = getNumberEdges();
+
+	// Classify each edge as its best scoring symbol, if it is consistent with any
+	for (int i = 0; i < numberEdgesFound; i++) {
+		const double *edgeScores = &arena.edgeScores[(size_t)i * DEBRUIJN_NUMBER_SYMBOLS];
+		double bestScore = 0;
+
+		arena.edgeSymbols[i] = -1;
+
+		for (int symbol = 0; symbol < DEBRUIJN_NUMBER_SYMBOLS; symbol++) {
+			if (edgeScores[symbol] > bestScore) {
+				bestScore = edgeScores[symbol];
+				arena.edgeSymbols[i] = symbol;
 			}
 		}
+	}
+
+	// Look up the window starting at each edge
+	for (int i = 0; i < numberEdgesFound; i++) {
+		arena.edgeWindowTransitions[i] = -1;
 
-		if (edgeIndex == 0) {
+		if (i + n > numberEdgesFound) {
 			continue;
 		}
 
-		pairScore **S;
-		int nCorrespondences = 0;
+		uint64_t window = 0;
+		bool classified = true;
 
-		S = (pairScore**) malloc(edgeIndex * sizeof(*S));
+		for (int w = 0; w < n && classified; w++) {
+			classified = arena.edgeSymbols[i + w] >= 0;
+			window = (window * DEBRUIJN_NUMBER_SYMBOLS) + arena.edgeSymbols[i + w];
+		}
 
-		for (int i = 0; i< edgeIndex; i++) { 
-			S[i] = (pairScore*)malloc(getNumberEdges() * sizeof(pairScore));
+		if (classified) {
+			unordered_map<uint64_t, int>::const_iterator windowTransition = windowTransitions.find(window);
 
-			for (int j = 0;j < getNumberEdges(); j++) {
-				S[i][j].score = 0;
-				S[i][j].numberItems = 0;
-				S[i][j].caseSigma = 0;
+			if (windowTransition != windowTransitions.end()) {
+				arena.edgeWindowTransitions[i] = windowTransition->second;
 			}
 		}
+	}
+
+	int nCorrespondences = 0;
+	int lastEdge = -1;
+	int lastTransition = -1;
 
-		sigma(edgeIndex - 1, getNumberEdges() - 1, transitions, edges, S);
+	for (int i = 0; i < numberEdgesFound; i++) {
+		int windowTransition = arena.edgeWindowTransitions[i];
 
-//		DB("edgeIndex - 1: " << (edgeIndex - 1) << " getNumberEdges() - 1: " << (getNumberEdges() - 1) << " y: " << y)
-		nCorrespondences = S[edgeIndex - 1][getNumberEdges() - 1].numberItems;
-		
-//		DB("Number of correspondences for y=" << y << ": " << nCorrespondences)
+		if (windowTransition < 0) {
+			continue;
+		}
 
-		int (*correspondences)[2] = new int[nCorrespondences][2];
-		
-		populateCorrespondences(edgeIndex - 1, getNumberEdges() - 1, correspondences, S);
+		// The previous window is -1 when unmatched, which must not confirm transition 0
+		bool confirmed =
+			(i > 0 && windowTransition > 0 && arena.edgeWindowTransitions[i - 1] == windowTransition - 1) ||
+			(i + 1 < numberEdgesFound && arena.edgeWindowTransitions[i + 1] == windowTransition + 1);
 
-		for (int i = 0; i < edgeIndex; i++) {
-			free(S[i]);
+		if (!confirmed) {
+			continue;
 		}
-		free(S);
 
-		for (int i = 0; i < nCorrespondences ; i++) {
-			int newX = correspondences[i][0];
-			int x = correspondence[newX];
+		for (int w = 0; w < n; w++) {
+			int edge = i + w;
+			int transition = windowTransition + w;
+
+			if (edge <= lastEdge || transition <= lastTransition) {
+				continue;
+			}
+
+			// Align the run between the previous match and this one
+			if (edge - lastEdge > 1 && transition - lastTransition > 1) {
+				nCorrespondences += alignEdges(lastEdge + 1, edge - lastEdge - 1, lastTransition + 1, transition - lastTransition - 1, arena, nCorrespondences);
+			}
 
-			int xPos = (correspondences[i][1] + 1);
+			arena.correspondenceEdges[nCorrespondences] = edge;
+			arena.correspondenceTransitions[nCorrespondences] = transition;
+			nCorrespondences++;
 
-			double displacement = experiment->getDisplacement(xPos, x);
-			slDepthExperimentResult result((int)(experiment->getImplementation()->getPatternXOffsetFactor(xPos) * projectorResolution.width), y, displacement);
-			experiment->storeResult(&result);
-    		}
+			lastEdge = edge;
+			lastTransition = transition;
+		}
+	}
 
-		delete[] correspondences;
-		delete[] differences;
-		delete[] edges;
+	// Align the run after the last match, or everything if there were no matches
+	if (lastEdge < numberEdgesFound - 1 && lastTransition < numberTransitions - 1) {
+		nCorrespondences += alignEdges(lastEdge + 1, numberEdgesFound - lastEdge - 1, lastTransition + 1, numberTransitions - lastTransition - 1, arena, nCorrespondences);
 	}
 
+	return nCorrespondences;
+}
+
+void DeBruijnImplementation::buildWindowTransitions() {
+	int numberTransitions = getNumberEdges();
+
+	windowTransitions.clear();
+
+	for (int j = 0; j + n <= numberTransitions; j++) {
+		uint64_t window = 0;
+
+		for (int w = 0; w < n; w++) {
+			window = (window * DEBRUIJN_NUMBER_SYMBOLS) + transitionSymbols[j + w];
+		}
+
+		pair<unordered_map<uint64_t, int>::iterator, bool> inserted = windowTransitions.insert(make_pair(window, j));
+
+		// A repeated window cannot identify its transitions
+		if (!inserted.second) {
+			inserted.first->second = -1;
+		}
+	}
+}
+
+const vector<int> &DeBruijnImplementation::getSequence(int k, int n) {
+	lock_guard<mutex> lock(sequenceCacheMutex);
+
+	pair<int, int> key(k, n);
+	map<pair<int, int>, vector<int> >::iterator cached = sequenceCache.find(key);
+
+	if (cached == sequenceCache.end()) {
+		vector<int> a(n + 1, 0);
+
+		cached = sequenceCache.insert(make_pair(key, vector<int>())).first;
+		db(1, 1, k, n, a, cached->second);
+	}
+
+	return cached->second;
 }
 
 void DeBruijnImplementation::db(int t, int p, int k, int n, vector<int> &a, vector<int> &sequence) {
@@ -229,100 +510,15 @@ double DeBruijnImplementation::consistency(int qc, int ec) {
 	}
 }
 
+// The least consistent channel
 double DeBruijnImplementation::score(Vec3s q, Vec3s e) {
-	double sr = consistency(q[0], e[0]);
-	double sg = consistency(q[1], e[1]);
-	double sb = consistency(q[2], e[2]);
+	double sr = consistencyTable[q[0] + 1][e[0] + 255];
+	double sg = consistencyTable[q[1] + 1][e[1] + 255];
+	double sb = consistencyTable[q[2] + 1][e[2] + 255];
 
-	if (sr > sg && sb > sg) {
-		return sg;
-	}
-	if (sr > sb) {
-		return sb;
-	}
-	return sr;
+	return min(sr, min(sg, sb));
 }
 
-double DeBruijnImplementation::sigma(int i, int  j, Vec3s *patterns, Vec3s *edges, pairScore **Scache) {
-	double value1, value2, value3;
-
-	if (i < 0 || j <  0) {
-		return 0;
-	}
-
-	if (Scache[i][j].caseSigma != 0) {
-		return Scache[i][j].score;
-	}
-
-	value1 = sigma(i - 1, j - 1, patterns, edges, Scache) + score(patterns[j], edges[i]);
-	value2 = sigma(i - 1, j, patterns, edges, Scache);
-	value3 = sigma(i, j - 1, patterns, edges, Scache);
-
-	if (value1 > value2 && value1 > value3) {
-		Scache[i][j].caseSigma = 1;
-		Scache[i][j].score = value1;
-
-		if (i == 0 || j == 0) {
-			Scache[i][j].numberItems = 1;
-		} else {
-			Scache[i][j].numberItems = Scache[i - 1][j - 1].numberItems + 1;
-		}
-
-		return value1;
-	}
-
-	if (value2 > value3) {
-		Scache[i][j].caseSigma = 2;
-		Scache[i][j].score = value2;
-
-		if (i == 0) {
-			Scache[i][j].numberItems = 0;
-		} else {
-			Scache[i][j].numberItems = Scache[i - 1][j].numberItems;
-		}
-
-		return value2;
-	}
-
-	Scache[i][j].caseSigma = 3;
-	Scache[i][j].score = value3;
-
-	if (j == 0) {
-		Scache[i][j].numberItems = 0;
-	} else {
-		Scache[i][j].numberItems = Scache[i][j - 1].numberItems;
-	}
-
-	return value3;
+int DeBruijnImplementation::getTransitionSymbol(Vec3s q) {
+	return ((q[0] + 1) * 9) + ((q[1] + 1) * 3) + (q[2] + 1);
 }
-
-void DeBruijnImplementation::populateCorrespondences(int i, int j, int correspondences[][2], pairScore **S) {
-	if (i < 0 || j < 0) {
-		return;
-	}
-	
-	/* Find if we are in case 1, 2 or 3 */
-	/*if(S[i][j].score > S[i-1][j].score && S[i][j].score > S[i][j-1].score){*/
-
-	switch (S[i][j].caseSigma) {
-		case 1: {
-				correspondences[S[i][j].numberItems - 1][0] = i;
-				correspondences[S[i][j].numberItems - 1][1] = j;
-				populateCorrespondences(i - 1, j - 1, correspondences, S);
-			}
-			break;
-		case 2: {
-				populateCorrespondences(i - 1, j, correspondences, S);
-			}
-			break;
-		case 3:	{
-				populateCorrespondences(i, j - 1, correspondences, S);
-			}
-			break;
-		default: {
-				DB("ERROR CHECKING CASE in populateCorrespondences")
-			}
-	}
-
-}
-
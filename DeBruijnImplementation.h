@@ -3,9 +3,19 @@
 
 #include "slBenchmark.h"
 
+#include <unordered_map>
+
+// The default alphabet size and window size of the sequence
 #define DEBRUIJN_K 5
 #define DEBRUIJN_N 3
 
+// Each sequence value is xor'ed into a 3 bit colour, so at most 7 values can be used
+#define DEBRUIJN_MAX_K 7
+// Windows of transition symbols are packed in base 27 into 64 bits
+#define DEBRUIJN_MAX_N 13
+// The longest sequence (k^n values) generated, far more than a projector has columns
+#define DEBRUIJN_MAX_SEQUENCE_LENGTH 65536
+
 #define DEBRUIJN_ALPHA 0.2
 #define DEBRUIJN_BETA 0.8
 //#define DEBRUIJN_ALPHA -1.0
@@ -14,17 +24,58 @@
 //#define DEBRUIJN_THRESHOLD 5000
 #define DEBRUIJN_THRESHOLD 200
 
+// The number of possible transitions ({-1,0,1} per channel), and edge channel differences (-255 to 255)
+#define DEBRUIJN_NUMBER_SYMBOLS 27
+#define DEBRUIJN_NUMBER_DIFFERENCES 511
+
+// The default number of row ranges the capture is split into, 0 for one per OpenCV thread
+#define DEBRUIJN_DEFAULT_ROW_RANGES 0
+
 using namespace cv;
 
-typedef struct {
-	double score;
-	int numberItems;
-	int caseSigma;
-} pairScore;
+// The ways the edges of a capture row can be matched to the pattern transitions
+enum DeBruijnDecodeMode {
+	DEBRUIJN_DECODE_ALIGNMENT,	// Align all the edges with all the transitions
+	DEBRUIJN_DECODE_WINDOW_HASH	// Look up windows of classified edges, aligning only the runs between them
+};
+
+// The alignment step chosen for a cell of the correspondence table
+enum {
+	DEBRUIJN_CASE_MATCH = 1,	// The edge matches the pattern transition
+	DEBRUIJN_CASE_SKIP_EDGE,	// The edge is skipped
+	DEBRUIJN_CASE_SKIP_TRANSITION	// The pattern transition is skipped
+};
+
+// Reusable storage for decoding the rows of a capture, sized once for
+// the capture width so decoding a row does not allocate
+struct DeBruijnDecodeArena {
+	void resize(int, int);
+
+	vector<Vec3s> differences;
+	vector<int> gradients;
+	vector<Vec3s> edges;
+	vector<int> edgeXs;
+	// The score of each edge against each transition symbol
+	vector<double> edgeScores;
+	// The best scoring symbol of each edge (or -1), and the transition
+	// the window of symbols starting at each edge was found at (or -1)
+	vector<int> edgeSymbols;
+	vector<int> edgeWindowTransitions;
+	// Two rows of alignment scores, and the case of every cell
+	vector<double> previousScores;
+	vector<double> currentScores;
+	vector<unsigned char> cases;
+	// The matched edge and pattern transition indexes
+	vector<int> correspondenceEdges;
+	vector<int> correspondenceTransitions;
+};
 
 class DeBruijnImplementation : public slImplementation {
+	friend class DeBruijnRowDecoder;
+
 	public:
-		DeBruijnImplementation(unsigned int);
+		// Create with a number of columns, and optionally the sequence alphabet size and window size
+		DeBruijnImplementation(unsigned int, int = DEBRUIJN_K, int = DEBRUIJN_N);
 		virtual ~DeBruijnImplementation() {};
 		void preExperimentRun();
 		void postExperimentRun();
@@ -33,21 +84,56 @@ class DeBruijnImplementation : public slImplementation {
 		virtual Mat generatePattern();
 		void calculateCroppedCapture();
 		virtual void processCapture(Mat);
+		virtual int getNumberCapturesRetained() {return 1;}
 		virtual void postIterationsProcess();
 		
 		unsigned int getNumberColumns();
 		unsigned int getNumberEdges();
+		int getK();
+		int getN();
+		// Set the number of row ranges the capture is split into, 0 for one per OpenCV thread. At most
+		// N ranges are decoded concurrently, on the OpenCV thread pool, which sets the number of threads
+		void setNumberRowRanges(int);
+		// Set how the edges of each row are matched to the pattern transitions
+		void setDecodeMode(DeBruijnDecodeMode);
 
 	protected:
-		void db(int, int, int, int, vector<int> &, vector<int> &);
+		static void db(int, int, int, int, vector<int> &, vector<int> &);
+		// Get the de Bruijn sequence for an alphabet size and window size, generated once and shared
+		static const vector<int> &getSequence(int, int);
+		// Build the column colours, transitions, transition symbols and windows from the sequence
+		void buildTransitions();
 		double clamp(double, double, double);
 		double consistency(int, int);
 		double score(Vec3s, Vec3s);
-		double sigma(int, int, Vec3s *, Vec3s *, pairScore **);
-		void populateCorrespondences(int, int, int[][2], pairScore **);
+		// The index (0 to 26) of a transition among all possible transitions
+		static int getTransitionSymbol(Vec3s);
+		// Decode a capture row into depth results
+		void decodeRow(int, const Mat &, DeBruijnDecodeArena &, vector<slDepthExperimentResult> &);
+		// Score the edges of a row against every transition symbol
+		void scoreEdges(int, DeBruijnDecodeArena &);
+		// Align a run of edges (first, count) with a run of pattern transitions (first, count), appending
+		// the correspondences after a number already found and returning the number added
+		int alignEdges(int, int, int, int, DeBruijnDecodeArena &, int);
+		// Match the edges of a row through windowTransitions, aligning the runs between matches, returning the number of correspondences
+		int decodeWindows(int, DeBruijnDecodeArena &);
+		// Index every window of n pattern transition symbols by the transition it starts at
+		void buildWindowTransitions();
+		// The colour (a bit per channel) of each pattern column
+		int *columnColours;
 		Vec3s *transitions;
+		// The symbol of each pattern transition
+		int *transitionSymbols;
+		// The consistency of each transition channel value (-1, 0, 1) with each edge channel difference
+		double consistencyTable[3][DEBRUIJN_NUMBER_DIFFERENCES];
+		// The transition each window of symbols starts at, -1 if it appears more than once
+		unordered_map<uint64_t, int> windowTransitions;
 	private:
     		double numberEdges;
+		int k;
+		int n;
+		int numberRowRanges;
+		DeBruijnDecodeMode decodeMode;
 };
 
 #endif //DEBRUIJN_IMPLEMENTATION_H
@@ -4,6 +4,19 @@ GrayCodedBinaryImplementation::GrayCodedBinaryImplementation(int newNumberColumn
 	setIdentifier(string("GrayCodedBinaryImplementation"));
 }
 
+void GrayCodedBinaryImplementation::preExperimentRun() {
+	BinaryImplementation::preExperimentRun();
+
+	// Convert every possible Gray code once, rather than once per pixel
+	int numberPatterns = getNumberPatterns();
+
+	grayCodeDecodeTable.resize(1 << numberPatterns);
+
+	for (int grayCode = 0; grayCode < (int)grayCodeDecodeTable.size(); grayCode++) {
+		grayCodeDecodeTable[grayCode] = convertGrayCodeToInteger(grayCode, numberPatterns);
+	}
+}
+
 Mat GrayCodedBinaryImplementation::generatePattern() {
 	Mat pattern;
 	Scalar colour;
@@ -27,29 +40,12 @@ Mat GrayCodedBinaryImplementation::generatePattern() {
 	return pattern;
 }
 
-// Getters and Setters
-double GrayCodedBinaryImplementation::getBinaryCode(int xProjector, int y) {
-	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
-/*	
-	int binCode = this->binaryCode[(y * cameraResolution.width) + xProjector];
-	if(binCode == -1) return -1;
-	return convertGrayCodeToInteger(binCode, numberColumns, getNumberPatterns());
-*/
-
-	for (int x = 0; x < cameraResolution.width; x++) {
-		int currentBinaryCode = binaryCode[(y * cameraResolution.width) + x];
-
-		if (currentBinaryCode != -1) {
-			int binaryXProjector = convertGrayCodeToInteger(currentBinaryCode, getNumberPatterns());
-
-			if (binaryXProjector == xProjector) {
-				return (double)x;
-			}
-		}
+int GrayCodedBinaryImplementation::decodeCode(int grayCode) {
+	if (grayCode < 0 || grayCode >= (int)grayCodeDecodeTable.size()) {
+		return -1;
 	}
 
-	return -1;
-
+	return grayCodeDecodeTable[grayCode];
 }
 
 
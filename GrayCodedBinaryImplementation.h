@@ -7,9 +7,14 @@ class GrayCodedBinaryImplementation : public BinaryImplementation {
 	public:
 		GrayCodedBinaryImplementation(int);
 		virtual ~GrayCodedBinaryImplementation() {};
+		void preExperimentRun();
 		virtual Mat generatePattern();
-		virtual double getBinaryCode(int, int);
+		// Looks up the integer of a Gray code in grayCodeDecodeTable
+		virtual int decodeCode(int);
 		int convertGrayCodeToInteger(int, int);
+	private:
+		// The integer of every Gray code of the configured number of patterns
+		vector<int> grayCodeDecodeTable;
 };
 
 #endif //GRAY_CODED_BINARY_IMPLEMENTATION_H
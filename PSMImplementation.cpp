@@ -1,28 +1,44 @@
 #include "PSMImplementation.h"
+#include <opencv2/core/hal/intrin.hpp>
 
-PSMImplementation::PSMImplementation(): slImplementation(string("PSMImplementation")),numberColumns(32) {
+PSMImplementation::PSMImplementation(): slImplementation(string("PSMImplementation")),numberColumns(32),unwrapMode(PSM_UNWRAP_SEQUENTIAL),numberSteps(PSM_DEFAULT_NUMBER_STEPS) {
 }
 
-PSMImplementation::PSMImplementation(unsigned int nCol): slImplementation(string("PSMImplementation")),numberColumns(nCol) {
+PSMImplementation::PSMImplementation(unsigned int nCol): slImplementation(string("PSMImplementation")),numberColumns(nCol),unwrapMode(PSM_UNWRAP_SEQUENTIAL),numberSteps(PSM_DEFAULT_NUMBER_STEPS) {
 }
 void PSMImplementation::preExperimentRun() {
-	pixelsToProcess = new priority_queue<WrappedPixel, vector<WrappedPixel>, CompareWrappedPixel>();
+	pixelsToProcess = new PSMBucketQueue();
 
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 
 	int arraySize = cameraResolution.width * cameraResolution.height;
 
+	phaseSin = new float[arraySize];
+	phaseCos = new float[arraySize];
 	phase = new float[arraySize];
 	dist = new float[arraySize];
 	//mask = new bool[arraySize];
 	//ready = new bool[arraySize];
 	mask = new int[arraySize];
 	ready = new int[arraySize];
+
+	// Temporal unwrapping starts from a single column, which needs no unwrapping
+	frequencies.clear();
+
+	if (unwrapMode == PSM_UNWRAP_TEMPORAL) {
+		for (int frequency = 1; frequency < getNumberColumns(); frequency *= PSM_TEMPORAL_FREQUENCY_RATIO) {
+			frequencies.push_back(frequency);
+		}
+	}
+
+	frequencies.push_back(getNumberColumns());
 }
 
 void PSMImplementation::postExperimentRun() {
 	delete pixelsToProcess;
 
+	delete[] phaseSin;
+	delete[] phaseCos;
 	delete[] phase;
 	delete[] dist;
 	delete[] mask;
@@ -30,13 +46,30 @@ void PSMImplementation::postExperimentRun() {
 }
 
 bool PSMImplementation::hasMoreIterations() {
-        return experiment->getIterationIndex() < 3;
+        return experiment->getIterationIndex() < numberSteps * (int)frequencies.size();
 }
 
 unsigned int PSMImplementation::getNumberColumns() {
     return this->numberColumns;
 }
 
+void PSMImplementation::setUnwrapMode(PSMUnwrapMode newUnwrapMode) {
+	unwrapMode = newUnwrapMode;
+}
+
+void PSMImplementation::setNumberSteps(int newNumberSteps) {
+	if (newNumberSteps < 3) {
+		FATAL("PSMImplementation needs at least 3 steps, not " << newNumberSteps)
+	}
+
+	numberSteps = newNumberSteps;
+}
+
+// Step n of N is shifted by -2pi(n + 1) / N, so 3 steps are shifted by -2pi/3, 2pi/3 and 0
+static inline double getPhaseShift(int step, int numberSteps) {
+	return -PSM_TWO_PI * (step + 1) / numberSteps;
+}
+
 // For Phase shift methods we use the number of columns
 // to determine the "size" of the pattern...
 double PSMImplementation::getPatternWidth() {
@@ -51,33 +84,23 @@ Mat PSMImplementation::generatePattern() {
 	int screenWidth = (int)projectorResolution.width;
 	int screenHeight = (int)projectorResolution.height;
 
-	int columnWidth = screenWidth / getNumberColumns();
+	// Each frequency is numberSteps phase shifted patterns
+	int frequency = frequencies[iterationIndex / numberSteps];
+	double shift = getPhaseShift(iterationIndex % numberSteps, numberSteps);
+	int columnWidth = screenWidth / frequency;
 
-//	float offset = -1.6;
-	float offset = -2.075;
+	float offset = PSM_PHASE_OFFSET;
 	
 	Mat pattern(screenHeight, screenWidth, CV_8UC3);
 
-	for (int column = 0; column < getNumberColumns(); column++) {
+	for (int column = 0; column < frequency; column++) {
 		int columnX = (column * columnWidth);
 
 		for (int x = columnX; x < (columnX + columnWidth); x++) {
 			float theta = ((PSM_TWO_PI / columnWidth) * x) + offset;
 //			float theta = ((PSM_TWO_PI / columnWidth) * x);
 
-			double phaseIntensity;
-
-			switch (iterationIndex) {
-				case 0:
-					phaseIntensity = ((cos(theta - PSM_TWO_PI_ON_3) + 1.0) / 2.0) * 255.0;
-					break;
-				case 1:
-					phaseIntensity = ((cos(theta + PSM_TWO_PI_ON_3) + 1.0) / 2.0) * 255.0;
-					break;
-				case 2:
-					phaseIntensity = ((cos(theta) + 1.0) / 2.0) * 255.0;
-					break;
-			}
+			double phaseIntensity = ((cos(theta + shift) + 1.0) / 2.0) * 255.0;
 
 			line(pattern, Point(x, 0), Point(x, screenHeight - 1), Scalar(phaseIntensity, phaseIntensity, phaseIntensity));
 		}
@@ -86,36 +109,317 @@ Mat PSMImplementation::generatePattern() {
 	return pattern;
 }
 
+#if CV_SIMD128
+/**
+ * Sums the colour channels of 16 BGR pixels into four vectors of floats.
+ */
+static inline void v_loadColourTotals(const uchar *pixels, v_float32x4 colourTotals[4]) {
+	v_uint8x16 blue, green, red;
+	v_load_deinterleave(pixels, blue, green, red);
+
+	v_uint16x8 blueLow, blueHigh, greenLow, greenHigh, redLow, redHigh;
+	v_expand(blue, blueLow, blueHigh);
+	v_expand(green, greenLow, greenHigh);
+	v_expand(red, redLow, redHigh);
+
+	v_uint32x4 totals[4];
+	v_expand(blueLow + greenLow + redLow, totals[0], totals[1]);
+	v_expand(blueHigh + greenHigh + redHigh, totals[2], totals[3]);
+
+	for (int quarter = 0; quarter < 4; quarter++) {
+		colourTotals[quarter] = v_cvt_f32(v_reinterpret_as_s32(totals[quarter]));
+	}
+}
+#endif
+
+/**
+ * Adds rows of a capture's brightness times the sine and cosine of its
+ * phase shift to the sums, for use with parallel_for_. The first step of
+ * a frequency starts the sums.
+ */
+class PSMStepAccumulator : public ParallelLoopBody {
+	public:
+		PSMStepAccumulator(const Mat &newCaptureMat, float *newPhaseSin, float *newPhaseCos, float newShiftSin, float newShiftCos, bool newFirst):
+			captureMat(newCaptureMat), phaseSin(newPhaseSin), phaseCos(newPhaseCos), shiftSin(newShiftSin), shiftCos(newShiftCos), first(newFirst) {};
+
+		void operator()(const Range &rowRange) const {
+			int width = captureMat.cols;
+			const float brightnessScale = 1.0f / (255.0f * 3.0f);
+#if CV_SIMD128
+			v_float32x4 brightnessScales = v_setall_f32(brightnessScale);
+			v_float32x4 shiftSins = v_setall_f32(shiftSin);
+			v_float32x4 shiftCoss = v_setall_f32(shiftCos);
+#endif
+
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				const uchar *captureRow = captureMat.ptr<uchar>(y);
+				float *phaseSinRow = phaseSin + (y * width);
+				float *phaseCosRow = phaseCos + (y * width);
+
+				int x = 0;
+#if CV_SIMD128
+				for (; x <= width - 16; x += 16) {
+					v_float32x4 colourTotals[4];
+					v_loadColourTotals(captureRow + (x * 3), colourTotals);
+
+					for (int quarter = 0; quarter < 4; quarter++) {
+						int offset = x + (quarter * 4);
+						v_float32x4 brightness = colourTotals[quarter] * brightnessScales;
+						v_float32x4 sins = brightness * shiftSins;
+						v_float32x4 coss = brightness * shiftCoss;
+
+						v_store(phaseSinRow + offset, first ? sins : v_load(phaseSinRow + offset) + sins);
+						v_store(phaseCosRow + offset, first ? coss : v_load(phaseCosRow + offset) + coss);
+					}
+				}
+#endif
+				for (; x < width; x++) {
+					float brightness = (captureRow[(x * 3)] + captureRow[(x * 3) + 1] + captureRow[(x * 3) + 2]) * brightnessScale;
+
+					phaseSinRow[x] = (first ? 0.0f : phaseSinRow[x]) + (brightness * shiftSin);
+					phaseCosRow[x] = (first ? 0.0f : phaseCosRow[x]) + (brightness * shiftCos);
+				}
+			}
+		}
+
+	private:
+		const Mat &captureMat;
+		float *phaseSin;
+		float *phaseCos;
+		float shiftSin;
+		float shiftCos;
+		bool first;
+};
+
+// Captures are added to the sums as they arrive, so none are kept
 void PSMImplementation::processCapture(Mat captureMat) {
 	experiment->storeCapture(captureMat);
+
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int iterationIndex = experiment->getIterationIndex();
+	int step = iterationIndex % numberSteps;
+	double shift = getPhaseShift(step, numberSteps);
+
+	parallel_for_(Range(0, cameraResolution.height), PSMStepAccumulator(captureMat, phaseSin, phaseCos, (float)sin(shift), (float)cos(shift), step == 0));
+
+	// Each frequency is unwrapped as soon as its captures are in
+	if (unwrapMode == PSM_UNWRAP_TEMPORAL && step == numberSteps - 1) {
+		phaseUnwrapTemporal(iterationIndex / numberSteps);
+	}
 }
 
 void PSMImplementation::postIterationsProcess() {
+	if (unwrapMode == PSM_UNWRAP_TEMPORAL) {
+		makeDepth();
+		return;
+	}
+
 	phaseWrap();
-	phaseUnwrap();
+
+	if (unwrapMode == PSM_UNWRAP_TILED) {
+		phaseUnwrapTiled();
+	} else {
+		phaseUnwrap();
+	}
+
 	makeDepth();
 }
 
 /**
- * max(|a-b|,1-|a-b|)
+ * min(|a-b|,1-|a-b|)
  */
-float PSMImplementation::diff(float a, float b) {
+static inline float phaseDifference(float a, float b) {
 	float d = (a < b ? b - a : a - b);
-	return (d < 0.5 ? d : 1 - d);
+	return (d < 0.5f ? d : 1.0f - d);
 }
 
-float PSMImplementation::min(float a, float b, float c) {
-	return (a < b && a < c ? a : (b < c ? b : c));
+/**
+ * atan2(y, x) / 2pi, from a minimax polynomial for atan on [0, 1] and the
+ * octant of (x, y). The error is under 1e-6 of a turn. v_phaseTurns below
+ * is the same for four pixels at a time.
+ */
+static inline float phaseTurns(float y, float x) {
+	float ax = fabsf(x);
+	float ay = fabsf(y);
+	float maxA = ax > ay ? ax : ay;
+	float minA = ax > ay ? ay : ax;
+	float z = maxA > 0.0f ? minA / maxA : 0.0f;
+	float z2 = z * z;
+	float a = z * (0.99997726f + z2 * (-0.33262347f + z2 * (0.19354346f + z2 * (-0.11643287f + z2 * (0.05265332f + z2 * -0.01172120f)))));
+
+	a = ay > ax ? 1.57079633f - a : a;
+	a = x < 0.0f ? 3.14159265f - a : a;
+	a = y < 0.0f ? -a : a;
+
+	return a * (1.0f / (float)PSM_TWO_PI);
 }
 
-float PSMImplementation::max(float a, float b, float c) {
-	return (a > b && a > c ? a : (b > c ? b : c));
+#if CV_SIMD128
+/**
+ * phaseDifference for four pixels at a time.
+ */
+static inline v_float32x4 v_phaseDifference(const v_float32x4 &a, const v_float32x4 &b) {
+	v_float32x4 d = v_abs(a - b);
+	return v_select(d < v_setall_f32(0.5f), d, v_setall_f32(1.0f) - d);
 }
 
-float PSMImplementation::averageBrightness(int r, int g, int b) {
-	return (r + g + b) / (255.0f * 3.0f);
+/**
+ * phaseTurns for four pixels at a time, the octant picked with selects.
+ */
+static inline v_float32x4 v_phaseTurns(const v_float32x4 &y, const v_float32x4 &x) {
+	v_float32x4 zero = v_setzero_f32();
+	v_float32x4 ax = v_abs(x);
+	v_float32x4 ay = v_abs(y);
+	v_float32x4 maxA = v_max(ax, ay);
+	v_float32x4 z = v_select(maxA > zero, v_min(ax, ay) / maxA, zero);
+	v_float32x4 z2 = z * z;
+	v_float32x4 a = z * (v_setall_f32(0.99997726f) + z2 * (v_setall_f32(-0.33262347f) + z2 * (v_setall_f32(0.19354346f) + z2 * (v_setall_f32(-0.11643287f) + z2 * (v_setall_f32(0.05265332f) + z2 * v_setall_f32(-0.01172120f))))));
+
+	a = v_select(ay > ax, v_setall_f32(1.57079633f) - a, a);
+	a = v_select(x < zero, v_setall_f32(3.14159265f) - a, a);
+	a = v_select(y < zero, zero - a, a);
+
+	return a * v_setall_f32(1.0f / (float)PSM_TWO_PI);
 }
+#endif
 
+/**
+ * Wraps rows of the sums, for use with parallel_for_. For a brightness of
+ * a + b cos(theta + shift) the sums are -(N / 2) b sin(theta) and
+ * (N / 2) b cos(theta), giving the pattern phase theta and the
+ * modulation b. The noise measure (left in dist) is sqrt(3) b, the largest
+ * max - min range of three step captures, so PSM_NOISE_THRESHOLD keeps its
+ * meaning. The wrapped phase is 2/3 - theta / 2pi, as the three step
+ * formula gave.
+ */
+class PSMPhaseWrapper : public ParallelLoopBody {
+	public:
+		PSMPhaseWrapper(int newWidth, const float *newPhaseSin, const float *newPhaseCos, int newNumberSteps, float *newPhase, float *newDist, int *newMask, int *newReady):
+			width(newWidth), phaseSin(newPhaseSin), phaseCos(newPhaseCos), numberSteps(newNumberSteps), phase(newPhase), dist(newDist), mask(newMask), ready(newReady) {};
+
+		void operator()(const Range &rowRange) const {
+			const float rangeScale = (2.0f * sqrt(3.0f)) / numberSteps;
+			const float noiseThreshold = (float)PSM_NOISE_THRESHOLD;
+#if CV_SIMD128
+			v_float32x4 rangeScales = v_setall_f32(rangeScale);
+			v_float32x4 noiseThresholds = v_setall_f32(noiseThreshold);
+			v_float32x4 twoThirds = v_setall_f32(2.0f / 3.0f);
+			v_float32x4 halves = v_setall_f32(0.5f);
+			v_int32x4 ones = v_setall_s32(1);
+#endif
+
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				const float *phaseSinRow = phaseSin + (y * width);
+				const float *phaseCosRow = phaseCos + (y * width);
+				float *phaseRow = phase + (y * width);
+				float *distRow = dist + (y * width);
+				int *maskRow = mask + (y * width);
+				int *readyRow = ready + (y * width);
+
+				int x = 0;
+#if CV_SIMD128
+				for (; x <= width - 4; x += 4) {
+					v_float32x4 sins = v_load(phaseSinRow + x);
+					v_float32x4 coss = v_load(phaseCosRow + x);
+					v_float32x4 phaseRanges = rangeScales * v_sqrt((sins * sins) + (coss * coss));
+					v_int32x4 noisy = v_reinterpret_as_s32(phaseRanges <= noiseThresholds) & ones;
+					v_float32x4 wrappedPhases = twoThirds - v_phaseTurns(v_setzero_f32() - sins, coss);
+
+					v_store(maskRow + x, noisy);
+					v_store(readyRow + x, ones - noisy);
+					v_store(distRow + x, phaseRanges);
+					v_store(phaseRow + x, wrappedPhases - v_cvt_f32(v_floor(wrappedPhases + halves)));
+				}
+#endif
+				for (; x < width; x++) {
+					float phaseRange = rangeScale * sqrt((phaseSinRow[x] * phaseSinRow[x]) + (phaseCosRow[x] * phaseCosRow[x]));
+					int noisy = phaseRange <= noiseThreshold;
+					float wrappedPhase = (2.0f / 3.0f) - phaseTurns(-phaseSinRow[x], phaseCosRow[x]);
+
+					maskRow[x] = noisy;
+					readyRow[x] = 1 - noisy;
+					distRow[x] = phaseRange;
+					phaseRow[x] = wrappedPhase - floorf(wrappedPhase + 0.5f);
+				}
+			}
+		}
+
+	private:
+		int width;
+		const float *phaseSin;
+		const float *phaseCos;
+		int numberSteps;
+		float *phase;
+		float *dist;
+		int *mask;
+		int *ready;
+};
+
+/**
+ * Computes the quality (the phase difference with the four neighbours over
+ * the brightness range) of tiles of the wrapped phase, for use with
+ * parallel_for_. Border pixels keep their brightness range.
+ */
+class PSMQualityMapper : public ParallelLoopBody {
+	public:
+		PSMQualityMapper(int newWidth, int newHeight, const float *newPhase, float *newDist, const int *newMask):
+			width(newWidth), height(newHeight), tilesPerRow((newWidth + PSM_QUALITY_TILE_SIZE - 1) / PSM_QUALITY_TILE_SIZE), phase(newPhase), dist(newDist), mask(newMask) {};
+
+		void operator()(const Range &tileRange) const {
+			for (int tile = tileRange.start; tile < tileRange.end; tile++) {
+				int tileX = (tile % tilesPerRow) * PSM_QUALITY_TILE_SIZE;
+				int tileY = (tile / tilesPerRow) * PSM_QUALITY_TILE_SIZE;
+				int startX = std::max(tileX, 1);
+				int endX = std::min(tileX + PSM_QUALITY_TILE_SIZE, width - 1);
+				int startY = std::max(tileY, 1);
+				int endY = std::min(tileY + PSM_QUALITY_TILE_SIZE, height - 1);
+
+				for (int y = startY; y < endY; y++) {
+					const float *phaseRow = phase + (y * width);
+					const float *phaseRowAbove = phaseRow - width;
+					const float *phaseRowBelow = phaseRow + width;
+					float *distRow = dist + (y * width);
+					const int *maskRow = mask + (y * width);
+
+					int x = startX;
+#if CV_SIMD128
+					for (; x <= endX - 4; x += 4) {
+						v_float32x4 phases = v_load(phaseRow + x);
+						v_float32x4 dists = v_load(distRow + x);
+						v_float32x4 qualities = (
+							v_phaseDifference(phases, v_load(phaseRow + x - 1)) +
+							v_phaseDifference(phases, v_load(phaseRow + x + 1)) +
+							v_phaseDifference(phases, v_load(phaseRowAbove + x)) +
+							v_phaseDifference(phases, v_load(phaseRowBelow + x))
+						) / dists;
+						v_float32x4 unmasked = v_reinterpret_as_f32(v_load(maskRow + x) == v_setzero_s32());
+
+						v_store(distRow + x, v_select(unmasked, qualities, dists));
+					}
+#endif
+					for (; x < endX; x++) {
+						float quality = (
+							phaseDifference(phaseRow[x], phaseRow[x - 1]) +
+							phaseDifference(phaseRow[x], phaseRow[x + 1]) +
+							phaseDifference(phaseRow[x], phaseRowAbove[x]) +
+							phaseDifference(phaseRow[x], phaseRowBelow[x])
+						) / distRow[x];
+
+						distRow[x] = maskRow[x] == 0 ? quality : distRow[x];
+					}
+				}
+			}
+		}
+
+	private:
+		int width;
+		int height;
+		int tilesPerRow;
+		const float *phase;
+		float *dist;
+		const int *mask;
+};
 
 /**
  * The function phaseWrap computes the phase of the pattern at each point (x,y),
@@ -124,59 +428,90 @@ float PSMImplementation::averageBrightness(int r, int g, int b) {
 void PSMImplementation::phaseWrap() {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 
-	float sqrt3 = sqrt(3);
-
-	Mat phase1Mat = experiment->getCaptureAt(0);
-	Mat phase2Mat = experiment->getCaptureAt(1);
-	Mat phase3Mat = experiment->getCaptureAt(2);
-	
-	for (int y = 0; y < cameraResolution.height; y++) {
-		for (int x = 0; x < cameraResolution.width; x++) {
-			/* Start by getting the intensity of the image at the point for each image*/
-			Vec3b phase1PixelBGR = phase1Mat.at<Vec3b>(y, x);
-			Vec3b phase2PixelBGR = phase2Mat.at<Vec3b>(y, x);
-			Vec3b phase3PixelBGR = phase3Mat.at<Vec3b>(y, x);
+	parallel_for_(Range(0, cameraResolution.height), PSMPhaseWrapper(cameraResolution.width, phaseSin, phaseCos, numberSteps, phase, dist, mask, ready));
 
-			float phase1 = averageBrightness((int)phase1PixelBGR[2], (int)phase1PixelBGR[1], (int)phase1PixelBGR[0]);
-			float phase2 = averageBrightness((int)phase2PixelBGR[2], (int)phase2PixelBGR[1], (int)phase2PixelBGR[0]);
-			float phase3 = averageBrightness((int)phase3PixelBGR[2], (int)phase3PixelBGR[1], (int)phase3PixelBGR[0]);
+	int tilesPerRow = (cameraResolution.width + PSM_QUALITY_TILE_SIZE - 1) / PSM_QUALITY_TILE_SIZE;
+	int tilesPerColumn = (cameraResolution.height + PSM_QUALITY_TILE_SIZE - 1) / PSM_QUALITY_TILE_SIZE;
 
-			/* Maximum intensity minus minimum intensity */
-			float phaseRange = max(phase1, phase2, phase3) - min(phase1, phase2, phase3);
-
-			int arrayOffset = (y * cameraResolution.width) + x;
+	parallel_for_(Range(0, tilesPerRow * tilesPerColumn), PSMQualityMapper(cameraResolution.width, cameraResolution.height, phase, dist, mask));
+}
 
-			if (phaseRange <= PSM_NOISE_THRESHOLD) {
-				//mask[arrayOffset] = false; //1
-				//ready[arrayOffset] = true; //0
-				mask[arrayOffset] = 1;
-				ready[arrayOffset] = 0;
-			} else {
-				//mask[arrayOffset] = true; //0
-				//ready[arrayOffset] = false; //1
-				mask[arrayOffset] = 0;
-				ready[arrayOffset] = 1;
+/**
+ * Wraps rows of the sums of a temporal unwrapping frequency and unwraps
+ * them with the unwrapped phase of the frequency before, for use with
+ * parallel_for_. The position within a column is
+ * v = (theta - offset) / 2pi (mod 1), and the unwrapped position (in
+ * columns) from the frequency before, scaled up to this frequency, picks
+ * the column. No pixel depends on another.
+ */
+class PSMTemporalUnwrapper : public ParallelLoopBody {
+	public:
+		PSMTemporalUnwrapper(int newWidth, const float *newPhaseSin, const float *newPhaseCos, int newNumberSteps, float *newPhase, float *newDist, int *newMask, int *newReady, bool newFirst, float newScale):
+			width(newWidth), phaseSin(newPhaseSin), phaseCos(newPhaseCos), numberSteps(newNumberSteps), phase(newPhase), dist(newDist), mask(newMask), ready(newReady), first(newFirst), scale(newScale) {};
+
+		void operator()(const Range &rowRange) const {
+			const float rangeScale = (2.0f * sqrt(3.0f)) / numberSteps;
+			const float columnOffset = (float)(PSM_PHASE_OFFSET / PSM_TWO_PI);
+
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				const float *phaseSinRow = phaseSin + (y * width);
+				const float *phaseCosRow = phaseCos + (y * width);
+				float *phaseRow = phase + (y * width);
+				float *distRow = dist + (y * width);
+				int *maskRow = mask + (y * width);
+				int *readyRow = ready + (y * width);
+
+				for (int x = 0; x < width; x++) {
+					float phaseRange = rangeScale * sqrt((phaseSinRow[x] * phaseSinRow[x]) + (phaseCosRow[x] * phaseCosRow[x]));
+					int noisy = phaseRange <= PSM_NOISE_THRESHOLD;
+
+					float v = phaseTurns(-phaseSinRow[x], phaseCosRow[x]) - columnOffset;
+					v -= floorf(v);
+
+					// A pixel is only as good as its noisiest frequency
+					float column = first ? v : v + floorf((phaseRow[x] * scale) - v + 0.5f);
+
+					phaseRow[x] = column;
+					maskRow[x] = first ? noisy : maskRow[x] | noisy;
+					readyRow[x] = 0;
+					distRow[x] = (first || phaseRange < distRow[x]) ? phaseRange : distRow[x];
+				}
 			}
+		}
 
-			dist[arrayOffset] = phaseRange;
+	private:
+		int width;
+		const float *phaseSin;
+		const float *phaseCos;
+		int numberSteps;
+		float *phase;
+		float *dist;
+		int *mask;
+		int *ready;
+		bool first;
+		float scale;
+};
+
+void PSMImplementation::phaseUnwrapTemporal(int frequencyIndex) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
 
-			phase[arrayOffset] = atan2(sqrt3 * (phase1 - phase3), 2.0f * phase2 - phase1 - phase3) / PSM_TWO_PI;
-		}
+	// The patterns use whole pixel column widths, so scale by those
+	float scale = 1.0f;
+
+	if (frequencyIndex > 0) {
+		scale = (float)(projectorResolution.width / frequencies[frequencyIndex - 1]) / (projectorResolution.width / frequencies[frequencyIndex]);
 	}
 
-	for (int y = 1; y < cameraResolution.height - 1; y++) {
-		for (int x = 1; x < cameraResolution.width - 1; x++) {
-			int arrayOffset = (y * cameraResolution.width) + x;
+	parallel_for_(Range(0, cameraResolution.height), PSMTemporalUnwrapper(cameraResolution.width, phaseSin, phaseCos, numberSteps, phase, dist, mask, ready, frequencyIndex == 0, scale));
 
-			//if (mask[arrayOffset]) { // == 0
-			if (mask[arrayOffset] == 0) {
-				dist[arrayOffset] = (
-					diff(phase[arrayOffset], phase[arrayOffset - 1]) +
-					diff(phase[arrayOffset], phase[arrayOffset + 1]) +
-					diff(phase[arrayOffset], phase[((y - 1) * cameraResolution.width) + x]) +
-					diff(phase[arrayOffset], phase[((y + 1) * cameraResolution.width) + x])
-				) / dist[arrayOffset];
-			}
+	// makeDepth takes the pattern position as half the columns less the phase
+	if (frequencyIndex == (int)frequencies.size() - 1) {
+		int arraySize = cameraResolution.width * cameraResolution.height;
+		float halfColumns = (float)(getNumberColumns() / 2);
+
+		for (int arrayOffset = 0; arrayOffset < arraySize; arrayOffset++) {
+			phase[arrayOffset] = halfColumns - phase[arrayOffset];
 		}
 	}
 }
@@ -189,55 +524,61 @@ void PSMImplementation::phaseWrap() {
 void PSMImplementation::phaseUnwrap() {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 
-	//int startX = cameraResolution.width / 2;
-	int startX = (cameraResolution.width / 2) + 225;
-	int startY = cameraResolution.height / 2;
+	int seed = findUnwrapSeed(Rect(1, 1, cameraResolution.width - 2, cameraResolution.height - 2));
+
+	if (seed < 0) {
+		return;
+	}
+
+	int reference = findReferencePixel();
+	float referenceWrappedPhase = reference >= 0 ? phase[reference] : 0.0f;
 
-	struct WrappedPixel firstWrappedPixel;
+	pixelsToProcess->clear();
+	pixelsToProcess->push(0, seed, phase[seed]);
 
-	firstWrappedPixel.x = startX;
-	firstWrappedPixel.y = startY;
-	firstWrappedPixel.dist = 0;
-	firstWrappedPixel.phase = phase[(startY * cameraResolution.width) + startX];
+	unwrapArea(pixelsToProcess, Rect(0, 0, cameraResolution.width, cameraResolution.height));
 
-	pixelsToProcess->push(firstWrappedPixel);
+	alignToReference(reference, referenceWrappedPhase);
+}
+
+// Pixels are taken best quality first, so unwrapping follows the
+// smoothest paths and errors in noisy areas do not spread
+void PSMImplementation::unwrapArea(PSMBucketQueue *queue, Rect area) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 
-	while (!pixelsToProcess->empty()) {
-		struct WrappedPixel currentPixel = pixelsToProcess->top();
-		pixelsToProcess->pop();
+	int width = cameraResolution.width;
 
-		int x = currentPixel.x;
-		int y = currentPixel.y;
+	while (!queue->empty()) {
+		PSMUnwrapEntry currentPixel = queue->pop();
 
-		int arrayOffset = (y * cameraResolution.width) + x;
+		int arrayOffset = currentPixel.index;
 
 		//if (!ready[arrayOffset]) { // == 1
 		if (ready[arrayOffset] == 1) {
+			int x = arrayOffset % width;
+			int y = arrayOffset / width;
+
 			phase[arrayOffset] = currentPixel.phase;
 			//ready[arrayOffset] = true; // 0
 			ready[arrayOffset] = 0;
 
-			if (y > 0) {
-				phaseUnwrap(x, y - 1, currentPixel.dist, currentPixel.phase);
+			if (y > area.y) {
+				phaseUnwrap(queue, arrayOffset - width, currentPixel.phase);
 			}
-			if (y < cameraResolution.height - 1) {
-				phaseUnwrap(x, y + 1, currentPixel.dist, currentPixel.phase);
+			if (y < area.y + area.height - 1) {
+				phaseUnwrap(queue, arrayOffset + width, currentPixel.phase);
 			}
-			if (x > 0) {
-				phaseUnwrap(x - 1, y, currentPixel.dist, currentPixel.phase);
+			if (x > area.x) {
+				phaseUnwrap(queue, arrayOffset - 1, currentPixel.phase);
 			}
-			if (x < cameraResolution.width - 1) {
-				phaseUnwrap(x + 1, y, currentPixel.dist, currentPixel.phase);
+			if (x < area.x + area.width - 1) {
+				phaseUnwrap(queue, arrayOffset + 1, currentPixel.phase);
 			}
 		}
 	}
 }
 
-void PSMImplementation::phaseUnwrap(int x, int y, float unwrapDist, float unwrapPhase) {
-	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
-
-	int arrayOffset = (y * cameraResolution.width) + x;
-
+void PSMImplementation::phaseUnwrap(PSMBucketQueue *queue, int arrayOffset, float unwrapPhase) {
 	//if (ready[arrayOffset]) { // == 1
 	if (ready[arrayOffset] == 1) {
 		float diff = phase[arrayOffset] - (unwrapPhase - (int)unwrapPhase);
@@ -248,24 +589,334 @@ void PSMImplementation::phaseUnwrap(int x, int y, float unwrapDist, float unwrap
 		if (diff < -0.5f) {
 			diff++;
 		}
-		
-		struct WrappedPixel nextWrappedPixel;
 
-		nextWrappedPixel.x = x;
-		nextWrappedPixel.y = y;
-		nextWrappedPixel.dist = unwrapDist + dist[arrayOffset];
-		nextWrappedPixel.phase = unwrapPhase + diff;
+		queue->push(PSMBucketQueue::getBucket(dist[arrayOffset]), arrayOffset, unwrapPhase + diff);
+	}
+}
+
+// The seed is the best quality unmasked pixel, which should be away from
+// the border, where the quality is only the brightness range
+int PSMImplementation::findUnwrapSeed(Rect area) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int width = cameraResolution.width;
+	int seed = -1;
+
+	for (int y = area.y; y < area.y + area.height; y++) {
+		for (int x = area.x; x < area.x + area.width; x++) {
+			int arrayOffset = (y * width) + x;
+
+			if (mask[arrayOffset] == 0 && (seed < 0 || dist[arrayOffset] < dist[seed])) {
+				seed = arrayOffset;
+			}
+		}
+	}
+
+	return seed;
+}
+
+// The reference pixel sees the projector's centre column, so its wrapped
+// phase is what makeDepth expects. A masked reference is replaced with
+// the nearest unmasked pixel around it.
+int PSMImplementation::findReferencePixel() {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int width = cameraResolution.width;
+	int referenceX = (width / 2) + PSM_REFERENCE_X_OFFSET;
+	int referenceY = (cameraResolution.height / 2) + PSM_REFERENCE_Y_OFFSET;
+	int reference = -1;
+	int referenceDistance = 0;
+
+	for (int y = std::max(referenceY - PSM_REFERENCE_SEARCH_RADIUS, 0); y <= std::min(referenceY + PSM_REFERENCE_SEARCH_RADIUS, cameraResolution.height - 1); y++) {
+		for (int x = std::max(referenceX - PSM_REFERENCE_SEARCH_RADIUS, 0); x <= std::min(referenceX + PSM_REFERENCE_SEARCH_RADIUS, width - 1); x++) {
+			int arrayOffset = (y * width) + x;
+			int distance = ((x - referenceX) * (x - referenceX)) + ((y - referenceY) * (y - referenceY));
+
+			if (mask[arrayOffset] == 0 && (reference < 0 || distance < referenceDistance)) {
+				reference = arrayOffset;
+				referenceDistance = distance;
+			}
+		}
+	}
+
+	return reference;
+}
 
-		pixelsToProcess->push(nextWrappedPixel);
+// Unwrapping from any seed only fixes the phase up to whole periods, so
+// shift it back into the reference pixel's own period
+void PSMImplementation::alignToReference(int reference, float referenceWrappedPhase) {
+	if (reference < 0 || mask[reference] != 0 || ready[reference] != 0) {
+		return;
 	}
+
+	float periods = round(phase[reference] - referenceWrappedPhase);
+
+	if (periods == 0.0f) {
+		return;
+	}
+
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int arraySize = cameraResolution.width * cameraResolution.height;
+
+	for (int arrayOffset = 0; arrayOffset < arraySize; arrayOffset++) {
+		if (mask[arrayOffset] == 0 && ready[arrayOffset] == 0) {
+			phase[arrayOffset] -= periods;
+		}
+	}
+}
+
+Rect PSMImplementation::getUnwrapTile(int tile) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int tileX = (tile % tilesPerRow) * PSM_UNWRAP_TILE_SIZE;
+	int tileY = (tile / tilesPerRow) * PSM_UNWRAP_TILE_SIZE;
+
+	return Rect(tileX, tileY, std::min(PSM_UNWRAP_TILE_SIZE, cameraResolution.width - tileX), std::min(PSM_UNWRAP_TILE_SIZE, cameraResolution.height - tileY));
+}
+
+/**
+ * Unwraps tiles from their own seeds, for use with parallel_for_. Each
+ * range has its own queue, and unwrapping never leaves a tile, so ranges
+ * never touch the same pixels.
+ */
+class PSMTileUnwrapper : public ParallelLoopBody {
+	public:
+		PSMTileUnwrapper(PSMImplementation *newImplementation, vector<int> &newTileSeeds): implementation(newImplementation), tileSeeds(newTileSeeds) {};
+
+		void operator()(const Range &tileRange) const {
+			PSMBucketQueue queue;
+
+			for (int tile = tileRange.start; tile < tileRange.end; tile++) {
+				Rect area = implementation->getUnwrapTile(tile);
+				int seed = implementation->findUnwrapSeed(area);
+
+				tileSeeds[tile] = seed;
+
+				if (seed >= 0) {
+					queue.push(0, seed, implementation->phase[seed]);
+					implementation->unwrapArea(&queue, area);
+				}
+			}
+		}
+
+	private:
+		PSMImplementation *implementation;
+		vector<int> &tileSeeds;
+};
+
+/**
+ * Adds the stitched phase offset to the unwrapped pixels of tiles, for use
+ * with parallel_for_. The pixels of tiles that could not be stitched are
+ * wrapped again and left to be unwrapped from their neighbours.
+ */
+class PSMTileOffsetter : public ParallelLoopBody {
+	public:
+		PSMTileOffsetter(PSMImplementation *newImplementation, const vector<int> &newTileOffsets, const vector<int> &newTilesStitched): implementation(newImplementation), tileOffsets(newTileOffsets), tilesStitched(newTilesStitched) {};
+
+		void operator()(const Range &tileRange) const {
+			int width = implementation->experiment->getInfrastructure()->getCameraResolution().width;
+
+			for (int tile = tileRange.start; tile < tileRange.end; tile++) {
+				Rect area = implementation->getUnwrapTile(tile);
+
+				if (tilesStitched[tile] && tileOffsets[tile] == 0) {
+					continue;
+				}
+
+				for (int y = area.y; y < area.y + area.height; y++) {
+					for (int x = area.x; x < area.x + area.width; x++) {
+						int arrayOffset = (y * width) + x;
+
+						if (implementation->mask[arrayOffset] != 0 || implementation->ready[arrayOffset] != 0) {
+							continue;
+						}
+
+						if (tilesStitched[tile]) {
+							implementation->phase[arrayOffset] += tileOffsets[tile];
+						} else {
+							implementation->phase[arrayOffset] -= round(implementation->phase[arrayOffset]);
+							implementation->ready[arrayOffset] = 1;
+						}
+					}
+				}
+			}
+		}
+
+	private:
+		PSMImplementation *implementation;
+		const vector<int> &tileOffsets;
+		const vector<int> &tilesStitched;
+};
+
+// Neighbouring pixels on either side of the border should have nearly the
+// same phase, so each pair votes for the offset to add to tile B
+void PSMImplementation::voteTileOffset(PSMTileEdge &edge) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int width = cameraResolution.width;
+	Rect areaA = getUnwrapTile(edge.tileA);
+	Rect areaB = getUnwrapTile(edge.tileB);
+	bool horizontal = areaB.x > areaA.x;
+	int length = horizontal ? areaA.height : areaA.width;
+	map<int, int> votes;
+
+	for (int index = 0; index < length; index++) {
+		int offsetA = horizontal ?
+			((areaA.y + index) * width) + areaB.x - 1 :
+			((areaB.y - 1) * width) + areaA.x + index;
+		int offsetB = horizontal ? offsetA + 1 : offsetA + width;
+
+		if (mask[offsetA] == 0 && ready[offsetA] == 0 && mask[offsetB] == 0 && ready[offsetB] == 0) {
+			votes[(int)round(phase[offsetA] - phase[offsetB])]++;
+		}
+	}
+
+	edge.offset = 0;
+	edge.votes = 0;
+
+	for (map<int, int>::iterator vote = votes.begin(); vote != votes.end(); ++vote) {
+		if (vote->second > edge.votes) {
+			edge.offset = vote->first;
+			edge.votes = vote->second;
+		}
+	}
+}
+
+/**
+ * Unwraps tiles in parallel, then stitches them together along the
+ * maximum spanning tree of tile border votes from the tile with the best
+ * seed, so the most agreed on borders are used. Pixels left over (in
+ * tiles that could not be stitched, or cut off within their tile) are
+ * then unwrapped from their unwrapped neighbours.
+ */
+void PSMImplementation::phaseUnwrapTiled() {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int width = cameraResolution.width;
+	int height = cameraResolution.height;
+
+	tilesPerRow = (width + PSM_UNWRAP_TILE_SIZE - 1) / PSM_UNWRAP_TILE_SIZE;
+	tilesPerColumn = (height + PSM_UNWRAP_TILE_SIZE - 1) / PSM_UNWRAP_TILE_SIZE;
+
+	int numberTiles = tilesPerRow * tilesPerColumn;
+	vector<int> tileSeeds(numberTiles, -1);
+
+	int reference = findReferencePixel();
+	float referenceWrappedPhase = reference >= 0 ? phase[reference] : 0.0f;
+
+	parallel_for_(Range(0, numberTiles), PSMTileUnwrapper(this, tileSeeds));
+
+	// Vote on the offsets between each tile and the tiles to its right and below
+	vector<PSMTileEdge> edges;
+	int seedTile = -1;
+
+	for (int tile = 0; tile < numberTiles; tile++) {
+		if (tileSeeds[tile] < 0) {
+			continue;
+		}
+
+		if (seedTile < 0 || dist[tileSeeds[tile]] < dist[tileSeeds[seedTile]]) {
+			seedTile = tile;
+		}
+
+		int neighbours[2] = {
+			(tile % tilesPerRow) < tilesPerRow - 1 ? tile + 1 : -1,
+			tile + tilesPerRow < numberTiles ? tile + tilesPerRow : -1
+		};
+
+		for (int neighbour = 0; neighbour < 2; neighbour++) {
+			if (neighbours[neighbour] >= 0 && tileSeeds[neighbours[neighbour]] >= 0) {
+				PSMTileEdge edge = {tile, neighbours[neighbour], 0, 0};
+
+				voteTileOffset(edge);
+
+				if (edge.votes > 0) {
+					edges.push_back(edge);
+				}
+			}
+		}
+	}
+
+	if (seedTile < 0) {
+		return;
+	}
+
+	// Grow the spanning tree by the edge with the most votes leaving it
+	vector<int> tileOffsets(numberTiles, 0);
+	vector<int> tilesStitched(numberTiles, 0);
+
+	tilesStitched[seedTile] = 1;
+
+	while (true) {
+		int bestEdge = -1;
+
+		for (int edge = 0; edge < (int)edges.size(); edge++) {
+			if (tilesStitched[edges[edge].tileA] != tilesStitched[edges[edge].tileB] && (bestEdge < 0 || edges[edge].votes > edges[bestEdge].votes)) {
+				bestEdge = edge;
+			}
+		}
+
+		if (bestEdge < 0) {
+			break;
+		}
+
+		PSMTileEdge &edge = edges[bestEdge];
+
+		if (tilesStitched[edge.tileA]) {
+			tileOffsets[edge.tileB] = tileOffsets[edge.tileA] + edge.offset;
+			tilesStitched[edge.tileB] = 1;
+		} else {
+			tileOffsets[edge.tileA] = tileOffsets[edge.tileB] - edge.offset;
+			tilesStitched[edge.tileA] = 1;
+		}
+	}
+
+	parallel_for_(Range(0, numberTiles), PSMTileOffsetter(this, tileOffsets, tilesStitched));
+
+	// Queue the left over pixels from their unwrapped neighbours
+	pixelsToProcess->clear();
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int arrayOffset = (y * width) + x;
+
+			if (ready[arrayOffset] != 1) {
+				continue;
+			}
+
+			int neighbours[4] = {
+				y > 0 ? arrayOffset - width : -1,
+				y < height - 1 ? arrayOffset + width : -1,
+				x > 0 ? arrayOffset - 1 : -1,
+				x < width - 1 ? arrayOffset + 1 : -1
+			};
+
+			for (int neighbour = 0; neighbour < 4; neighbour++) {
+				if (neighbours[neighbour] >= 0 && mask[neighbours[neighbour]] == 0 && ready[neighbours[neighbour]] == 0) {
+					phaseUnwrap(pixelsToProcess, arrayOffset, phase[neighbours[neighbour]]);
+					break;
+				}
+			}
+		}
+	}
+
+	unwrapArea(pixelsToProcess, Rect(0, 0, width, height));
+
+	// The tree is anchored at the best seeded tile, so its whole period offset is arbitrary
+	alignToReference(reference, referenceWrappedPhase);
 }
 
 void PSMImplementation::makeDepth() {
 	slInfrastructure *infrastructure = experiment->getInfrastructure();
 	Size cameraResolution = infrastructure->getCameraResolution();
 	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
+
+	vector<slDepthExperimentResult> results;
 	
 	for (int y = 0; y < cameraResolution.height; y++) {
+		results.clear();
+
 		for (int x = 0; x < cameraResolution.width; x += PSM_RENDER_DETAIL) {
 			int arrayOffset = (y * cameraResolution.width) + x;
 
@@ -297,11 +948,12 @@ void PSMImplementation::makeDepth() {
 						DB("xProjectorDouble: " << xProjectorDouble <<" xProjector: " << xProjector << " displacement: " << displacement)
 					}
 
-					//slDepthExperimentResult result(x, y, displacement);
-					slDepthExperimentResult result(xProjector, y, displacement);
-					experiment->storeResult(&result);
+					//results.push_back(slDepthExperimentResult(x, y, displacement));
+					results.push_back(slDepthExperimentResult(xProjector, y, displacement));
 //				}
 			}
 		}
+
+		experiment->storeResults(results);
 	}
 }
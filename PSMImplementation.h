@@ -2,36 +2,120 @@
 #define PSM_IMPLEMENTATION_H
 
 #include "slBenchmark.h"
-#include <queue>
 
 #define PSM_NOISE_THRESHOLD 0.1
 #define PSM_TWO_PI 6.2831853
-#define PSM_TWO_PI_ON_3 PSM_TWO_PI / 3.0
+
+// The default number of phase shifted patterns per frequency
+#define PSM_DEFAULT_NUMBER_STEPS 3
+
+// The phase of the pattern at the left of the projector
+//#define PSM_PHASE_OFFSET -1.6
+#define PSM_PHASE_OFFSET -2.075
+
+// Each temporal unwrapping frequency is this many times the one before, up to the number of columns
+#define PSM_TEMPORAL_FREQUENCY_RATIO 8
 
 #define PSM_RENDER_DETAIL 1
 
-#define X_PROJECTOR_TOLERANCE 0.25
+// The width and height of the tiles the quality of the wrapped phase is computed over
+#define PSM_QUALITY_TILE_SIZE 64
+
+// The number of quality buckets pixels are unwrapped from, and the quality the last bucket starts at
+#define PSM_UNWRAP_BUCKETS 256
+#define PSM_UNWRAP_MAX_QUALITY 4.0f
+
+// The camera pixel (from the centre) that sees the projector's centre column, whose
+// wrapped phase is kept when unwrapping, and how far around it to look if it is masked
+#define PSM_REFERENCE_X_OFFSET 225
+#define PSM_REFERENCE_Y_OFFSET 0
+#define PSM_REFERENCE_SEARCH_RADIUS 32
+
+// The width and height of the tiles unwrapped in parallel
+#define PSM_UNWRAP_TILE_SIZE 128
 
 using namespace cv;
 
-struct WrappedPixel {
-	int x;
-	int y;
-	float dist;
+// The ways the wrapped phase can be unwrapped
+enum PSMUnwrapMode {
+	PSM_UNWRAP_SEQUENTIAL,	// Flood fill the whole capture from one seed
+	PSM_UNWRAP_TILED,	// Flood fill tiles in parallel from their own seeds, then stitch the tiles together
+	PSM_UNWRAP_TEMPORAL	// Project a hierarchy of frequencies, and unwrap each pixel from its own captures
+};
+
+// The integer phase offset between two neighbouring tiles most of their
+// bordering pixels agree on, and the number that agree
+struct PSMTileEdge {
+	int tileA;
+	int tileB;
+	int offset;
+	int votes;
+};
+
+#define X_PROJECTOR_TOLERANCE 0.25
+
+// A pixel waiting to be unwrapped, and its unwrapped phase
+struct PSMUnwrapEntry {
+	int index;
 	float phase;
 };
 
-struct CompareWrappedPixel {
-	bool operator()(const WrappedPixel& lhs, const WrappedPixel& rhs) const {
-		if (lhs.dist < rhs.dist) {
-			return true;
+// A queue of pixels bucketed by their quantised quality (lower is
+// better), where pushing and popping are constant time
+class PSMBucketQueue {
+	public:
+		PSMBucketQueue(): buckets(PSM_UNWRAP_BUCKETS), lowestBucket(PSM_UNWRAP_BUCKETS), size(0) {};
+
+		// Get the bucket of a quality, qualities past PSM_UNWRAP_MAX_QUALITY share the last bucket
+		static int getBucket(float quality) {
+			return quality < PSM_UNWRAP_MAX_QUALITY ? (int)(quality * (PSM_UNWRAP_BUCKETS / PSM_UNWRAP_MAX_QUALITY)) : PSM_UNWRAP_BUCKETS - 1;
 		}
 
-		return false;
-	}
+		void push(int bucket, int index, float phase) {
+			PSMUnwrapEntry entry = {index, phase};
+
+			buckets[bucket].push_back(entry);
+			lowestBucket = bucket < lowestBucket ? bucket : lowestBucket;
+			size++;
+		}
+
+		// Pop a pixel from the lowest bucket, the queue must not be empty
+		PSMUnwrapEntry pop() {
+			while (buckets[lowestBucket].empty()) {
+				lowestBucket++;
+			}
+
+			PSMUnwrapEntry entry = buckets[lowestBucket].back();
+			buckets[lowestBucket].pop_back();
+			size--;
+
+			return entry;
+		}
+
+		bool empty() const {
+			return size == 0;
+		}
+
+		// Empty the queue, keeping the bucket storage
+		void clear() {
+			for (int bucket = 0; bucket < PSM_UNWRAP_BUCKETS; bucket++) {
+				buckets[bucket].clear();
+			}
+
+			lowestBucket = PSM_UNWRAP_BUCKETS;
+			size = 0;
+		}
+
+	private:
+		vector<vector<PSMUnwrapEntry> > buckets;
+		int lowestBucket;
+		size_t size;
 };
 
 class PSMImplementation : public slImplementation {
+	friend class PSMTileUnwrapper;
+	friend class PSMTileOffsetter;
+
 	public:
 		PSMImplementation();
 		// Constructor to set the number of columns to something else that 32...
@@ -43,24 +127,49 @@ class PSMImplementation : public slImplementation {
 		virtual double getPatternWidth();
 		virtual Mat generatePattern();
 		virtual void processCapture(Mat);
+		virtual int getNumberCapturesRetained() {return 0;}
 		virtual void postIterationsProcess();
 		unsigned int getNumberColumns();
+		// Set how the wrapped phase is unwrapped
+		void setUnwrapMode(PSMUnwrapMode);
+		// Set the number of phase shifted patterns per frequency, at least 3
+		void setNumberSteps(int);
 
 	private:
-		float diff(float, float);
-		float min(float, float, float);
-		float max(float, float, float);
-		float averageBrightness(int, int, int);
-
 		void phaseWrap();
-		void phaseUnwrap(int, int, float, float);
+		// Queue a pixel to be unwrapped from a neighbour's unwrapped phase
+		void phaseUnwrap(PSMBucketQueue *, int, float);
 		void phaseUnwrap();
+		void phaseUnwrapTiled();
+		// Unwrap the queued pixels, spreading only within an area
+		void unwrapArea(PSMBucketQueue *, Rect);
+		// Find the unmasked pixel with the best quality in an area to unwrap from, or -1 if there are none
+		int findUnwrapSeed(Rect);
+		// Find the unmasked pixel nearest the reference pixel, or -1 if there are none close enough
+		int findReferencePixel();
+		// Shift the unwrapped phase by whole periods so the reference pixel keeps its wrapped phase
+		void alignToReference(int, float);
+		// Wrap the sums of a temporal unwrapping frequency, and unwrap them with the frequency before
+		void phaseUnwrapTemporal(int);
+		// Get the area of a tile
+		Rect getUnwrapTile(int);
+		// Count the votes of the pixels along the border of two unwrapped tiles for their phase offset
+		void voteTileOffset(PSMTileEdge &);
 		void makeDepth();
 
 		unsigned int numberColumns;
+		PSMUnwrapMode unwrapMode;
+		int numberSteps;
+		// The number of pattern columns of each frequency projected, lowest first
+		vector<int> frequencies;
+		int tilesPerRow;
+		int tilesPerColumn;
 
-		priority_queue<WrappedPixel, vector<WrappedPixel>, CompareWrappedPixel> *pixelsToProcess;
+		PSMBucketQueue *pixelsToProcess;
 
+		// The sums of each pixel's brightness times the sine and cosine of the phase shifts
+		float *phaseSin;
+		float *phaseCos;
 		float *phase;
 		float *dist;
 		//bool *mask;
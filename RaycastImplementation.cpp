@@ -3,10 +3,6 @@
 RaycastImplementation::RaycastImplementation(int newWidth): slImplementation(string("RaycastImplementation")), width(newWidth) {
 }
 
-void RaycastImplementation::preExperimentRun() {
-	((slBlenderVirtualInfrastructure *)experiment->getInfrastructure())->saveBlenderFile = true;
-}
-
 double RaycastImplementation::getPatternWidth() {
 	return (double)width;
 }
@@ -26,65 +22,73 @@ Mat RaycastImplementation::generatePattern() {
 	return pattern;
 }
 
-void RaycastImplementation::postIterationsProcess() {
-	stringstream blenderFilename, outputFilename, blenderCommandLine;
+//Casts the ground truth rays of a range of projector rows, for use with parallel_for_. Each row is
+//stored with storeResults, which experiments support calling concurrently for different rows
+class RaycastDepthCaster : public ParallelLoopBody {
+	public:
+		RaycastDepthCaster(slExperiment *newExperiment, const slVirtualScene &newVirtualScene, Vec3d newOrigin, int newWidth, int newHeight, double newDirectionY, double newDirectionZ):
+			experiment(newExperiment), virtualScene(newVirtualScene), origin(newOrigin), width(newWidth), height(newHeight), directionY(newDirectionY), directionZ(newDirectionZ) {};
 
-	blenderFilename << experiment->getPath() << "slVirtualScene_0.blend";
-	outputFilename << experiment->getPath() << "raycast_depth.xyz";
+		void operator()(const Range &rowRange) const {
+			vector<slDepthExperimentResult> depthResults;
+			slVirtualSceneHit hit;
 
-	slInfrastructure *infrastructure = experiment->getInfrastructure();
-	Size cameraResolution = infrastructure->getCameraResolution();
+			for (int y = rowRange.start; y < rowRange.end; y++) {
+				depthResults.clear();
 
-	blenderCommandLine
-		<< "blender -b -P RaycastDepth.py -- "
-			<< blenderFilename.str() << " "
-			<< outputFilename.str() << " "
-			<< width << " "
-			<< (int)cameraResolution.height;
+				double rayZ = directionZ - ((2.0 * directionZ * y) / height);
 
-	DB("blenderCommandLine: " << blenderCommandLine.str())
+				for (int x = 0; x < width; x++) {
+					Vec3d rayDirection(-1.0, -directionY + ((2.0 * directionY * x) / width), rayZ);
 
-	int exeResult = system(blenderCommandLine.str().c_str());
+					if (virtualScene.intersect(origin, rayDirection, DBL_MAX, &hit)) {
+						depthResults.push_back(slDepthExperimentResult(x, y, hit.location[0] - origin[0]));
+					}
+				}
 
-	ifstream raycastDepthfile(outputFilename.str().c_str());
-	string line;
+				//Each row is stored on its own, so rows can be stored from different threads
+				experiment->storeResults(depthResults);
+			}
+		}
 
-//	int lineNumber = 0;
-//	DB("starting to read raycast_depth.xyz file...");
-	while (getline(raycastDepthfile, line)) {
-/*
-		DB("#" << lineNumber << " " << line)
+	private:
+		slExperiment *experiment;
+		const slVirtualScene &virtualScene;
+		Vec3d origin;
+		int width, height;
+		double directionY, directionZ;
+};
 
-		if (lineNumber == 143643) { 
-			for (int index = 0; index < line.length(); index++) {
-				DB("line[" << index << "]: " << line[index] << " (" << (int)line[index] << ")")
-			}
-			//exit(0);
+void RaycastImplementation::postIterationsProcess() {
+	slInfrastructure *infrastructure = experiment->getInfrastructure();
+	slNativeVirtualInfrastructure *nativeVirtualInfrastructure = dynamic_cast<slNativeVirtualInfrastructure *>(infrastructure);
+	slBlenderVirtualInfrastructure *blenderVirtualInfrastructure = dynamic_cast<slBlenderVirtualInfrastructure *>(infrastructure);
+
+	slVirtualScene blenderVirtualScene;
+	const slVirtualScene *virtualScene = &blenderVirtualScene;
+
+	if (nativeVirtualInfrastructure != NULL) {
+		virtualScene = &nativeVirtualInfrastructure->getVirtualScene();
+	} else if (blenderVirtualInfrastructure != NULL) {
+		if (!blenderVirtualScene.load(blenderVirtualInfrastructure->virtualSceneJSONFilename)) {
+			FATAL("Could not load the virtual scene " << blenderVirtualInfrastructure->virtualSceneJSONFilename)
 		}
-*/
-		stringstream lineStream(line);
-		istream_iterator<string> iterator(lineStream);
-		istream_iterator<string> end;
-		vector<string> results(iterator, end);
-
-//		DB("converting x...");
-		int x = atoi(results[0].c_str());
-//		DB("converting y...");
-		int y = atoi(results[1].c_str());
-//		DB("converting z...");
-		double z = atof(results[2].c_str());
-
-//		DB("converting done");
-		slDepthExperimentResult result(x, y, z);
-//		DB("about to store result...");
-		experiment->storeResult(&result);
-//		DB("result stored");
-
-//		lineNumber++;
+	} else {
+		FATAL("RaycastImplementation needs a virtual infrastructure")
 	}
-//	DB("raycast_depth.xyz file read");
 
-	((slBlenderVirtualInfrastructure *)experiment->getInfrastructure())->saveBlenderFile = false;
-	//remove(outputFilename.str().c_str());
-}
+	Size cameraResolution = infrastructure->getCameraResolution();
+	int height = (int)cameraResolution.height;
+
+	//Cast a ray for each pattern column across the projector spot, and each camera row across the camera view
+	double directionY = tan((infrastructure->getProjectorHorizontalFOV() * M_PI) / 360.0);
+	double directionZ = tan((infrastructure->getCameraHorizontalFOV() * M_PI) / 360.0);
 
+	if (cameraResolution.width >= cameraResolution.height) {
+		directionZ = (directionZ * cameraResolution.height) / cameraResolution.width;
+	}
+
+	Vec3d origin(0.0, infrastructure->getCameraProjectorSeparation() / 2.0, 0.0);
+
+	parallel_for_(Range(0, height), RaycastDepthCaster(experiment, *virtualScene, origin, width, height, directionY, directionZ));
+}
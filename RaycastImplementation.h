@@ -9,10 +9,10 @@ class RaycastImplementation : public slImplementation {
 	public:
 		RaycastImplementation(int);
 		virtual ~RaycastImplementation() {};
-		void preExperimentRun();
 		virtual double getPatternWidth();
 		virtual Mat generatePattern();
 		virtual void postIterationsProcess();
+		virtual int getNumberCapturesRetained() {return 0;}
 		bool hasMoreIterations();
 		virtual double solveCorrespondence(int, int) {return 0;}
 	private:
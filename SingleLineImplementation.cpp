@@ -1,10 +1,39 @@
 #include "SingleLineImplementation.h"
 
-SingleLineImplementation::SingleLineImplementation(int newNumberColumns): slImplementation(string("SingleLineImplementation")), numberColumns(newNumberColumns) {
+SingleLineImplementation::SingleLineImplementation(int newNumberColumns): slImplementation(string("SingleLineImplementation")), numberColumns(newNumberColumns), numberLines(SINGLE_LINE_DEFAULT_NUMBER_LINES), disambiguation(SINGLE_LINE_BY_ORDER) {
+}
+
+// Line k of iteration i is at column i + (k * lineSpacing), and band k is
+// the columns of line k's sweep
+void SingleLineImplementation::preExperimentRun() {
+	lineSpacing = (numberColumns + numberLines - 1) / numberLines;
+	numberBandBits = 0;
+
+	if (disambiguation == SINGLE_LINE_BY_BAND) {
+		while ((1 << numberBandBits) < numberLines) {
+			numberBandBits++;
+		}
+	}
 }
 
 bool SingleLineImplementation::hasMoreIterations() {
-        return experiment->getIterationIndex() < numberColumns;
+        return experiment->getIterationIndex() < getNumberBandFrames() + lineSpacing;
+}
+
+void SingleLineImplementation::setNumberLines(int newNumberLines) {
+	if (newNumberLines < 1 || newNumberLines > numberColumns) {
+		FATAL("SingleLineImplementation needs from 1 to " << numberColumns << " lines, not " << newNumberLines)
+	}
+
+	numberLines = newNumberLines;
+}
+
+void SingleLineImplementation::setDisambiguation(SingleLineDisambiguation newDisambiguation) {
+	disambiguation = newDisambiguation;
+}
+
+int SingleLineImplementation::getNumberBandFrames() {
+	return numberBandBits * 2;
 }
 
 double SingleLineImplementation::getPatternWidth() {
@@ -15,7 +44,7 @@ Mat SingleLineImplementation::generatePattern() {
 	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
 
 	double columnWidth = (double)projectorResolution.width / (double)numberColumns;
-	int columnOffset = (int)((double)experiment->getIterationIndex() * columnWidth);
+	int iterationIndex = experiment->getIterationIndex();
 
 	int projectorWidth = (int)projectorResolution.width;
 	int projectorHeight = (int)projectorResolution.height;
@@ -23,11 +52,122 @@ Mat SingleLineImplementation::generatePattern() {
 	Mat pattern(projectorHeight, projectorWidth, CV_8UC3, Scalar(SINGLE_LINE_BLACK_VAL, SINGLE_LINE_BLACK_VAL, SINGLE_LINE_BLACK_VAL));
 	Scalar colour(SINGLE_LINE_WHITE_VAL, SINGLE_LINE_WHITE_VAL, SINGLE_LINE_WHITE_VAL);
 
-	//rectangle(pattern, Point(columnOffset, 0), Point((columnOffset + ((int)columnWidth - 1)), projectorHeight), colour, FILLED);
-	rectangle(pattern, Point(columnOffset, 0), Point(columnOffset, projectorHeight), colour, FILLED);
+	// A bit of the Gray coded band, then its inverse
+	if (iterationIndex < getNumberBandFrames()) {
+		int bit = iterationIndex / 2;
+		bool inverse = (iterationIndex % 2) == 1;
+
+		for (int band = 0; band < numberLines; band++) {
+			int grayCode = band ^ (band >> 1);
+
+			if ((((grayCode >> bit) & 1) == 1) != inverse) {
+				int bandStart = (int)((double)(band * lineSpacing) * columnWidth);
+				int bandEnd = (int)((double)min((band + 1) * lineSpacing, numberColumns) * columnWidth);
+
+				rectangle(pattern, Point(bandStart, 0), Point(bandEnd - 1, projectorHeight), colour, FILLED);
+			}
+		}
+
+		return pattern;
+	}
+
+	int lineIteration = iterationIndex - getNumberBandFrames();
+
+	for (int xPattern = lineIteration; xPattern < numberColumns; xPattern += lineSpacing) {
+		int columnOffset = (int)((double)xPattern * columnWidth);
+
+		//rectangle(pattern, Point(columnOffset, 0), Point((columnOffset + ((int)columnWidth - 1)), projectorHeight), colour, FILLED);
+		rectangle(pattern, Point(columnOffset, 0), Point(columnOffset, projectorHeight), colour, FILLED);
+	}
 
 	return pattern;
 }
+
+// Band frames are read as they arrive, like the binary implementations,
+// so no captures are kept
+void SingleLineImplementation::processBandCapture(Mat captureMat, int bandFrame) {
+	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
+
+	int bit = bandFrame / 2;
+
+	if (bandFrame % 2 == 0) {
+		positiveColourTotals.create(cameraResolution.height, cameraResolution.width, CV_16UC1);
+
+		for (int y = 0; y < cameraResolution.height; y++) {
+			const uchar *captureRow = captureMat.ptr<uchar>(y);
+			ushort *colourTotalsRow = positiveColourTotals.ptr<ushort>(y);
+
+			for (int x = 0; x < cameraResolution.width; x++) {
+				colourTotalsRow[x] = (ushort)(captureRow[(x * 3)] + captureRow[(x * 3) + 1] + captureRow[(x * 3) + 2]);
+			}
+		}
+
+		return;
+	}
+
+	if (bit == 0) {
+		bandCodes.create(cameraResolution.height, cameraResolution.width, CV_16UC1);
+		bandCodes = Scalar(0);
+	}
+
+	for (int y = 0; y < cameraResolution.height; y++) {
+		const uchar *captureRow = captureMat.ptr<uchar>(y);
+		const ushort *colourTotalsRow = positiveColourTotals.ptr<ushort>(y);
+		ushort *bandCodesRow = bandCodes.ptr<ushort>(y);
+
+		for (int x = 0; x < cameraResolution.width; x++) {
+			int difference = (int)colourTotalsRow[x] - (captureRow[(x * 3)] + captureRow[(x * 3) + 1] + captureRow[(x * 3) + 2]);
+
+			if (bandCodesRow[x] == SINGLE_LINE_INVALID_BAND) {
+				continue;
+			}
+
+			if (abs(difference) < SINGLE_LINE_BAND_THRESHOLD) {
+				bandCodesRow[x] = SINGLE_LINE_INVALID_BAND;
+			} else if (difference > 0) {
+				bandCodesRow[x] |= (ushort)(1 << bit);
+			}
+
+			// Convert the Gray code once it is complete
+			if (bit == numberBandBits - 1 && bandCodesRow[x] != SINGLE_LINE_INVALID_BAND) {
+				int band = bandCodesRow[x];
+
+				for (int shift = 1; shift < 16; shift *= 2) {
+					band ^= band >> shift;
+				}
+
+				bandCodesRow[x] = (ushort)band;
+			}
+		}
+	}
+}
+
+// A lit line is a run of bright pixels, its column is the brightest of the run
+void SingleLineImplementation::findLinePeaks(const uchar *captureRow, int width, vector<int> &peakColumns, vector<int> &peakTotals) {
+	peakColumns.clear();
+	peakTotals.clear();
+
+	int columnMax = 0;
+	int xColumn = -1;
+
+	for (int column = 0; column <= width; column++) {
+		int colourTotal = column < width ? captureRow[(column * 3)] + captureRow[(column * 3) + 1] + captureRow[(column * 3) + 2] : 0;
+
+		if (colourTotal >= SINGLE_LINE_BLACK_THRESHOLD) {
+			if (colourTotal > columnMax) {
+				columnMax = colourTotal;
+				xColumn = column;
+			}
+		} else if (xColumn >= 0) {
+			peakColumns.push_back(xColumn);
+			peakTotals.push_back(columnMax);
+
+			columnMax = 0;
+			xColumn = -1;
+		}
+	}
+}
+
 /*
 void SingleLineImplementation::processCapture(Mat captureMat) {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
@@ -133,36 +273,77 @@ void SingleLineImplementation::processCapture(Mat captureMat) {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
 
-	int xPattern = experiment->getIterationIndex();
+	int iterationIndex = experiment->getIterationIndex();
+
+	if (iterationIndex < getNumberBandFrames()) {
+		processBandCapture(captureMat, iterationIndex);
+		return;
+	}
+
+	int lineIteration = iterationIndex - getNumberBandFrames();
+	int numberLinesLit = ((numberColumns - 1 - lineIteration) / lineSpacing) + 1;
+
+	vector<slDepthExperimentResult> results;
+	vector<int> peakColumns, peakTotals, peakLines;
 
 	for (int y = 0; y < cameraResolution.height; y++) {
-		int columnMax = 0;
-//		int foundColumn = -1;
-		int xColumn = -1;	
-		double xCamera = -1.0;
+		const uchar *captureRow = captureMat.ptr<uchar>(y);
 
-		for (int column = 0; column < cameraResolution.width; column++) {
-			Vec3b pixelBGR = captureMat.at<Vec3b>(y, column);
+		findLinePeaks(captureRow, cameraResolution.width, peakColumns, peakTotals);
 
-			int colourTotal = pixelBGR[0] + pixelBGR[1] + pixelBGR[2];
+		peakLines.assign(peakColumns.size(), -1);
 
-			if (colourTotal > columnMax) {
-				columnMax = colourTotal;
-				xColumn = column;
+		if (disambiguation == SINGLE_LINE_BY_BAND) {
+			// A single line needs no band frames, so is always band 0
+			const ushort *bandCodesRow = numberBandBits > 0 ? bandCodes.ptr<ushort>(y) : NULL;
+
+			for (int peak = 0; peak < (int)peakColumns.size(); peak++) {
+				int band = bandCodesRow != NULL ? bandCodesRow[peakColumns[peak]] : 0;
+
+				if (band < numberLinesLit) {
+					peakLines[peak] = band;
+				}
+			}
+		} else if ((int)peakColumns.size() >= numberLinesLit) {
+			// Drop the dimmest peaks until there is one per lit line, then match
+			// them in order. Of equally dim peaks the rightmost is dropped, so a
+			// single line keeps the leftmost of equally bright peaks.
+			while ((int)peakColumns.size() > numberLinesLit) {
+				int dimmestPeak = 0;
+
+				for (int peak = 1; peak < (int)peakTotals.size(); peak++) {
+					if (peakTotals[peak] <= peakTotals[dimmestPeak]) {
+						dimmestPeak = peak;
+					}
+				}
+
+				peakColumns.erase(peakColumns.begin() + dimmestPeak);
+				peakTotals.erase(peakTotals.begin() + dimmestPeak);
 			}
 
+			peakLines.resize(peakColumns.size());
+
+			for (int peak = 0; peak < (int)peakColumns.size(); peak++) {
+				peakLines[peak] = peak;
+			}
 		}
 
+		for (int peak = 0; peak < (int)peakColumns.size(); peak++) {
+			int xColumn = peakColumns[peak];
+			double xCamera = -1.0;
+
+			if (peakLines[peak] < 0) {
+				continue;
+			}
+
+			int xPattern = lineIteration + (peakLines[peak] * lineSpacing);
 
-		if (columnMax >= SINGLE_LINE_BLACK_THRESHOLD) {
 			double lineTotal = 0;
-        	        double aTotal = 0;
+			double aTotal = 0;
 
 			if (xColumn > 1 && xColumn < cameraResolution.width - 3) {
 				for (int column = xColumn - 2; column <= xColumn + 2; column++) {
-					Vec3b pixelBGR = captureMat.at<Vec3b>(y, column);
-
-					double colourTotal = (double)(pixelBGR[0] + pixelBGR[1] + pixelBGR[2]);
+					double colourTotal = (double)(captureRow[(column * 3)] + captureRow[(column * 3) + 1] + captureRow[(column * 3) + 2]);
 
 					lineTotal += colourTotal;
 					aTotal += ((double)column * colourTotal);
@@ -172,17 +353,18 @@ void SingleLineImplementation::processCapture(Mat captureMat) {
 				xCamera = aTotal / lineTotal;
 			}
 
-			if (!isnan(xCamera) && xCamera != -1) {				
+			if (!isnan(xCamera) && xCamera != -1) {
 				double displacement = experiment->getDisplacement(xPattern, xCamera);
 				int xProjector = (int)(experiment->getImplementation()->getPatternXOffsetFactor(xPattern) * projectorResolution.width);
 
 				if (!isinf(displacement)) {
-					slDepthExperimentResult result(xProjector, y, displacement);
-					experiment->storeResult(&result);
+					results.push_back(slDepthExperimentResult(xProjector, y, displacement));
 				}
 			}
 		}
 	}
+
+	experiment->storeResults(results);
 }
 
 
@@ -10,22 +10,57 @@
 #define SINGLE_LINE_BLACK_THRESHOLD 200
 #define SINGLE_LINE_PIXEL_THRESHOLD 0.1
 
+// The default number of evenly spaced lines lit in each pattern
+#define SINGLE_LINE_DEFAULT_NUMBER_LINES 1
+
+// The smallest difference between the colour totals of a band frame and its inverse for a band bit to be read
+#define SINGLE_LINE_BAND_THRESHOLD 60
+#define SINGLE_LINE_INVALID_BAND 0xFFFF
+
 using namespace cv;
 
+// The ways the lines found in a camera row are matched to the lit lines
+enum SingleLineDisambiguation {
+	SINGLE_LINE_BY_ORDER,	// In order, keeping the brightest found, and the whole row is discarded if fewer are found than lit (eg a line outside the camera's view)
+	SINGLE_LINE_BY_BAND	// By the band of each camera pixel, read from Gray coded band frames projected before the lines
+};
+
 class SingleLineImplementation : public slImplementation {
 	public:
 		SingleLineImplementation(int);
 		virtual ~SingleLineImplementation() {};
+		void preExperimentRun();
 		bool hasMoreIterations();
 		virtual double getPatternWidth();
 		virtual Mat generatePattern();
 		virtual void processCapture(Mat);
+		virtual int getNumberCapturesRetained() {return 0;}
 		virtual void postIterationsProcess() {};
 		//virtual double solveCorrespondence(int, int);
+		// Set the number of evenly spaced lines lit in each pattern
+		void setNumberLines(int);
+		// Set how the lines found are matched to the lit lines
+		void setDisambiguation(SingleLineDisambiguation);
 
 	protected:
+		// Get the number of band frames (a pattern and its inverse per bit) projected before the lines
+		int getNumberBandFrames();
+		// Read a bit of the band of each camera pixel from a band frame or its inverse
+		void processBandCapture(Mat, int);
+		// Find the brightest column of each run of bright pixels in a capture row
+		void findLinePeaks(const uchar *, int, vector<int> &, vector<int> &);
+
 		int numberColumns;
 		double *originalColumn;
+		int numberLines;
+		// The number of columns between lit lines, and the number of pattern iterations sweeping them
+		int lineSpacing;
+		int numberBandBits;
+		SingleLineDisambiguation disambiguation;
+		// The colour totals of the last band frame, to compare with its inverse
+		Mat positiveColourTotals;
+		// The band of each camera pixel, or SINGLE_LINE_INVALID_BAND
+		Mat bandCodes;
 };
 
 #endif //SINGLE_LINE_IMPLEMENTATION_H
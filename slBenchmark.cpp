@@ -30,6 +30,16 @@
 #include <direct.h>
 #endif
 
+//Sockets for the blender render server
+#ifndef _WIN32
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
 int makeDir(const char* name) {
 #ifdef _WIN32
 	return mkdir(name);
@@ -71,7 +81,11 @@ void slImplementation::postIterationsProcess() {
 	Size cameraResolution = experiment->getInfrastructure()->getCameraResolution();
 	Size projectorResolution = experiment->getInfrastructure()->getProjectorResolution();
 
+	vector<slDepthExperimentResult> results;
+
 	for (int y = 0; y < cameraResolution.height; y++) {
+		results.clear();
+
 		for (int xPattern = 0; xPattern < getPatternWidth(); xPattern++) {
 			double xCamera = solveCorrespondence(xPattern, y);	
 
@@ -80,11 +94,12 @@ void slImplementation::postIterationsProcess() {
 				int xProjector = (int)(experiment->getImplementation()->getPatternXOffsetFactor(xPattern) * projectorResolution.width);
 
 				if (!isinf(displacement)) {
-					slDepthExperimentResult result(xProjector, y, displacement);
-					experiment->storeResult(&result);
+					results.push_back(slDepthExperimentResult(xProjector, y, displacement));
 				}
 			}
 		}
+
+		experiment->storeResults(results);
 	}
 }
 
@@ -187,6 +202,57 @@ void slInfrastructure::init() {
 	}
 }
 
+//Build the undistortion maps once the calibration matrices are loaded
+void slInfrastructure::initUndistortion() {
+	initUndistortion(getCameraResolution());
+}
+
+//Build the undistortion maps for a given capture size
+void slInfrastructure::initUndistortion(Size captureSize) {
+	undistortionSize = captureSize;
+	undistortionIdentity = intrinsicMat.empty() || distortionMat.empty() || countNonZero(distortionMat) == 0;
+
+	if (undistortionIdentity) {
+		undistortionMap1.release();
+		undistortionMap2.release();
+	} else {
+		initUndistortRectifyMap(intrinsicMat, distortionMat, Mat(), intrinsicMat, captureSize, CV_16SC2, undistortionMap1, undistortionMap2);
+	}
+}
+
+//Undistort a capture using the calibration matrices
+Mat slInfrastructure::undistortCapture(Mat captureMat) {
+	if (captureMat.empty()) {
+		return captureMat;
+	}
+
+	if (captureMat.size() != undistortionSize) {
+		initUndistortion(captureMat.size());
+	}
+
+	if (undistortionIdentity) {
+		return captureMat;
+	}
+
+	Mat undistortedCaptureMat;
+	remap(captureMat, undistortedCaptureMat, undistortionMap1, undistortionMap2, INTER_LINEAR, BORDER_CONSTANT);
+
+	return undistortedCaptureMat;
+}
+
+//Project and capture a batch of patterns from consecutive iterations starting at an iteration index, by default one after the other
+vector<Mat> slInfrastructure::projectAndCaptureBatch(const vector<Mat> &patternMats, int firstIterationIndex) {
+	vector<Mat> captureMats(patternMats.size());
+
+	for (size_t patternIndex = 0; patternIndex < patternMats.size(); patternIndex++) {
+		slIterationScope iterationScope(firstIterationIndex + (int)patternIndex);
+
+		captureMats[patternIndex] = projectAndCapture(patternMats[patternIndex]);
+	}
+
+	return captureMats;
+}
+
 //The name of this infrastructure
 string slInfrastructure::getName() {
 	return name;
@@ -265,6 +331,11 @@ unsigned int slInfrastructure::getUniqueID() {
  * slBlenderVirtualInfrastructure
  */ 
 
+//Clean up
+slBlenderVirtualInfrastructure::~slBlenderVirtualInfrastructure() {
+	stopRenderServers();
+}
+
 //Initialise the infrastructure
 void slBlenderVirtualInfrastructure::init() {
 	string tempVirtualSceneJSONFilename = virtualSceneJSONFilename;
@@ -273,25 +344,111 @@ void slBlenderVirtualInfrastructure::init() {
 	slInfrastructure::init();
 
 	virtualSceneJSONFilename = tempVirtualSceneJSONFilename;
+
+	//Calibration (if any) renders the calibration scene one process at a time, the experiment scene is loaded once from here
+	if (useRenderServer) {
+		startRenderServers(1);
+	}
+}
+
+//Clean up after an experiment has run
+void slBlenderVirtualInfrastructure::postExperimentRun() {
+	stopRenderServers();
 }
 
 //Project the structured light implementation pattern and capture it
 Mat slBlenderVirtualInfrastructure::projectAndCapture(Mat patternMat) {
 	DB("-> slBlenderVirtualInfrastructure::projectAndCapture()")
 
-	stringstream patternFilename, captureFilename, outputFilename, blenderCommandLine;
+	Mat captureMat = renderPattern(0, experiment->getIterationIndex(), patternMat);
+	
+	DB("<- slBlenderVirtualInfrastructure::projectAndCapture()")
+
+	return captureMat;
+}
+
+//Project and capture a batch of patterns, spread across concurrent blender processes
+vector<Mat> slBlenderVirtualInfrastructure::projectAndCaptureBatch(const vector<Mat> &patternMats, int firstIterationIndex) {
+	DB("-> slBlenderVirtualInfrastructure::projectAndCaptureBatch()")
+
+	vector<Mat> captureMats(patternMats.size());
+
+	int numberWorkers = min(max(renderProcesses, 1), (int)patternMats.size());
+
+	if (useRenderServer) {
+		startRenderServers(numberWorkers);
+	}
+
+	//Each worker takes the next pattern not yet rendered, and renders with its own blender process
+	atomic<int> nextPatternIndex(0);
+	vector<thread> workers;
+
+	for (int workerIndex = 0; workerIndex < numberWorkers; workerIndex++) {
+		workers.push_back(thread([this, workerIndex, firstIterationIndex, &patternMats, &captureMats, &nextPatternIndex]() {
+			for (int patternIndex = nextPatternIndex++; patternIndex < (int)patternMats.size(); patternIndex = nextPatternIndex++) {
+				slIterationScope iterationScope(firstIterationIndex + patternIndex);
+
+				captureMats[patternIndex] = renderPattern(workerIndex, firstIterationIndex + patternIndex, patternMats[patternIndex]);
+			}
+		}));
+	}
+
+	for (size_t workerIndex = 0; workerIndex < workers.size(); workerIndex++) {
+		workers[workerIndex].join();
+	}
+
+	DB("<- slBlenderVirtualInfrastructure::projectAndCaptureBatch()")
+
+	return captureMats;
+}
+
+//Render the pattern of an iteration with a persistent blender process (or a single blender process if it is not running)
+Mat slBlenderVirtualInfrastructure::renderPattern(int workerIndex, int iterationIndex, Mat patternMat) {
+	stringstream patternFilename, captureFilename, outputFilename;
+
+	//Concurrent renders each need their own temporary files
+	patternFilename << "." << OS_SEP << "blender_tmp_pattern_" << iterationIndex << ".png";
+	captureFilename << "." << OS_SEP << "blender_tmp_capture_" << iterationIndex << ".png";
+	outputFilename << experiment->getPath() << OS_SEP << "slVirtualScene_" << iterationIndex << ".blend";
+
+	//The pattern file is only read back by blender, so skip compression
+	vector<int> patternParams;
+	patternParams.push_back(IMWRITE_PNG_COMPRESSION);
+	patternParams.push_back(0);
+
+	imwrite(patternFilename.str().c_str(), patternMat, patternParams);
+
+	bool rendered = false;
+
+	if (workerIndex < (int)renderServerSockets.size() && renderServerSockets[workerIndex] >= 0) {
+		rendered = renderWithServer(workerIndex, patternFilename.str(), captureFilename.str(), outputFilename.str());
+	}
+
+	if (!rendered) {
+		rendered = renderWithProcess(patternFilename.str(), captureFilename.str(), outputFilename.str());
+	}
+
+	if (!rendered) {
+		FATAL("Could not launch blender. Please ensure the blender executable can be found in the current path.")
+	}
+
+	Mat captureMat = imread(captureFilename.str().c_str());
 
-	patternFilename << "." << OS_SEP << "blender_tmp_pattern.png";
-	captureFilename << "." << OS_SEP << "blender_tmp_capture.png";
-	outputFilename << experiment->getPath() << OS_SEP << "slVirtualScene_" << experiment->getIterationIndex() << ".blend";
+	remove(patternFilename.str().c_str());
+	remove(captureFilename.str().c_str());
+
+	return captureMat;
+}
 
-	imwrite(patternFilename.str().c_str(), patternMat);
+//Render a pattern file to a capture file with a single blender process
+bool slBlenderVirtualInfrastructure::renderWithProcess(string patternFilename, string captureFilename, string outputFilename) {
+	stringstream blenderCommandLine;
 
 	blenderCommandLine 
 		<< "blender -b -P slBlenderVirtualInfrastructure.py -- " 
-			<< patternFilename.str() << " " 
-			<< captureFilename.str() << " " 
-			<< outputFilename.str() << " "
+			<< patternFilename << " " 
+			<< captureFilename << " " 
+			<< outputFilename << " "
 			<< (int)getCameraResolution().width << " " 
 			<< (int)getCameraResolution().height << " "
 			<< getCameraHorizontalFOV() << " "
@@ -305,20 +462,434 @@ Mat slBlenderVirtualInfrastructure::projectAndCapture(Mat patternMat) {
 	int exeResult = system(blenderCommandLine.str().c_str());
 	DB("exeResult: " << exeResult)
 
-	if (exeResult != 0) {
-		FATAL("Could not launch blender. Please ensure the blender executable can be found in the current path.")
+	return exeResult == 0;
+}
+
+//Ask the persistent blender processes to finish
+void slBlenderVirtualInfrastructure::stopRenderServers() {
+	for (int serverIndex = 0; serverIndex < (int)renderServerSockets.size(); serverIndex++) {
+		stopRenderServer(serverIndex);
 	}
 
-	Mat captureMat = imread(captureFilename.str().c_str());
+	renderServerSockets.clear();
+}
 
-	remove(patternFilename.str().c_str());
-	remove(captureFilename.str().c_str());
-	
-	DB("<- slBlenderVirtualInfrastructure::projectAndCapture()")
+#ifndef _WIN32
+//Do not raise SIGPIPE if the blender process has gone
+#ifdef MSG_NOSIGNAL
+#define RENDER_SERVER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define RENDER_SERVER_SEND_FLAGS 0
+#endif
+
+//Start persistent blender processes for the current virtual scene until there are a number of them, and wait for them to connect
+void slBlenderVirtualInfrastructure::startRenderServers(int numberServers) {
+	int numberServersToStart = numberServers - (int)renderServerSockets.size();
+
+	if (numberServersToStart <= 0) {
+		return;
+	}
+
+	//Listen on a port chosen by the system, the blender processes connect back to it
+	int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (listenSocket < 0) {
+		DB("WARNING: could not create render server socket, rendering one blender process per pattern")
+		return;
+	}
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	socklen_t addressLength = sizeof(address);
+
+	if (
+		bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(listenSocket, numberServersToStart) != 0 ||
+		getsockname(listenSocket, (struct sockaddr *)&address, &addressLength) != 0
+	) {
+		DB("WARNING: could not listen for the render server, rendering one blender process per pattern")
+		close(listenSocket);
+		return;
+	}
+
+	stringstream blenderCommandLine;
+
+	blenderCommandLine 
+		<< "blender -b -P slBlenderVirtualInfrastructure.py -- --server " 
+			<< ntohs(address.sin_port) << " "
+			<< (int)getCameraResolution().width << " " 
+			<< (int)getCameraResolution().height << " "
+			<< getCameraHorizontalFOV() << " "
+			<< getProjectorHorizontalFOV() << " "
+			<< getCameraProjectorSeparation() << " "
+			<< virtualSceneJSONFilename << " &";
+
+	DB("blenderCommandLine: " << blenderCommandLine.str())
+
+	//Launch all the processes before waiting, so they load the scene at the same time
+	int numberServersLaunched = 0;
+
+	for (int serverIndex = 0; serverIndex < numberServersToStart; serverIndex++) {
+		if (system(blenderCommandLine.str().c_str()) == 0) {
+			numberServersLaunched++;
+		}
+	}
+
+	if (numberServersLaunched < numberServersToStart) {
+		DB("WARNING: could not launch " << (numberServersToStart - numberServersLaunched) << " render servers, rendering one blender process per pattern instead")
+	}
+
+	time_t timeoutTime = time(NULL) + DEFAULT_RENDER_SERVER_TIMEOUT;
+
+	for (int serverIndex = 0; serverIndex < numberServersLaunched; serverIndex++) {
+		fd_set listenSockets;
+		FD_ZERO(&listenSockets);
+		FD_SET(listenSocket, &listenSockets);
+
+		struct timeval timeout;
+		timeout.tv_sec = max((long)(timeoutTime - time(NULL)), 0L);
+		timeout.tv_usec = 0;
+
+		int serverSocket = -1;
+
+		if (select(listenSocket + 1, &listenSockets, NULL, NULL, &timeout) > 0) {
+			serverSocket = accept(listenSocket, NULL, NULL);
+		}
+
+		if (serverSocket < 0) {
+			DB("WARNING: a render server did not connect, rendering one blender process per pattern instead")
+		}
+
+		renderServerSockets.push_back(serverSocket);
+	}
+
+	close(listenSocket);
+}
+
+//Ask a persistent blender process to finish
+void slBlenderVirtualInfrastructure::stopRenderServer(int serverIndex) {
+	if (renderServerSockets[serverIndex] >= 0) {
+		string request("quit\n");
+		send(renderServerSockets[serverIndex], request.c_str(), request.length(), RENDER_SERVER_SEND_FLAGS);
+
+		close(renderServerSockets[serverIndex]);
+		renderServerSockets[serverIndex] = -1;
+	}
+}
+
+//Render a pattern file to a capture file with a persistent blender process
+bool slBlenderVirtualInfrastructure::renderWithServer(int serverIndex, string patternFilename, string captureFilename, string outputFilename) {
+	int serverSocket = renderServerSockets[serverIndex];
+
+	stringstream requestStream;
+
+	requestStream 
+		<< "render\t"
+			<< patternFilename << "\t"
+			<< captureFilename << "\t"
+			<< outputFilename << "\t"
+			<< (saveBlenderFile ? "true" : "false") << "\n";
+
+	string request = requestStream.str();
+	const char *requestData = request.c_str();
+	size_t requestRemaining = request.length();
+
+	while (requestRemaining > 0) {
+		ssize_t sent = send(serverSocket, requestData, requestRemaining, RENDER_SERVER_SEND_FLAGS);
+
+		if (sent <= 0) {
+			DB("WARNING: lost render server #" << serverIndex << ", rendering one blender process per pattern instead")
+			stopRenderServer(serverIndex);
+			return false;
+		}
+
+		requestData += sent;
+		requestRemaining -= sent;
+	}
+
+	//Wait for the single line response
+	string response;
+	char responseChar;
+
+	while (recv(serverSocket, &responseChar, 1, 0) == 1 && responseChar != '\n') {
+		response += responseChar;
+	}
+
+	if (response != "done") {
+		DB("WARNING: render server #" << serverIndex << " failed (" << response << "), rendering one blender process per pattern instead")
+		stopRenderServer(serverIndex);
+		return false;
+	}
+
+	return true;
+}
+#else
+//Start persistent blender processes for the current virtual scene until there are a number of them, and wait for them to connect
+void slBlenderVirtualInfrastructure::startRenderServers(int numberServers) {
+	DB("WARNING: the render server is not supported on this platform, rendering one blender process per pattern")
+}
+
+//Ask a persistent blender process to finish
+void slBlenderVirtualInfrastructure::stopRenderServer(int serverIndex) {
+}
+
+//Render a pattern file to a capture file with a persistent blender process
+bool slBlenderVirtualInfrastructure::renderWithServer(int serverIndex, string patternFilename, string captureFilename, string outputFilename) {
+	return false;
+}
+#endif
+
+/*
+ * slNativeVirtualInfrastructure
+ */ 
+
+//Size of the table converting linear light into sRGB capture values
+#define NATIVE_VIRTUAL_SRGB_TABLE_SIZE	4096
+
+//Distance (relative to the light distance) shadow rays start away from a surface, so they do not hit it
+#define VIRTUAL_SHADOW_OFFSET		1e-7
+
+//Convert an sRGB value (0 to 1) to linear light, as blender does when loading the pattern image
+static double sRGBToLinear(double value) {
+	return value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+}
+
+//Convert linear light (0 to 1) to an sRGB value, as blender does when saving the capture image
+static double linearToSRGB(double value) {
+	return value <= 0.0031308 ? value * 12.92 : (1.055 * pow(value, 1.0 / 2.4)) - 0.055;
+}
+
+//Build the table converting linear light (0 to 1) to 8 bit sRGB capture values
+static vector<uchar> createLinearToSRGBTable() {
+	vector<uchar> table(NATIVE_VIRTUAL_SRGB_TABLE_SIZE);
+
+	for (int index = 0; index < NATIVE_VIRTUAL_SRGB_TABLE_SIZE; index++) {
+		table[index] = saturate_cast<uchar>(linearToSRGB((double)index / (NATIVE_VIRTUAL_SRGB_TABLE_SIZE - 1)) * 255.0);
+	}
+
+	return table;
+}
+
+//Renders rows of a native virtual capture, for use with parallel_for_
+class slNativeVirtualRenderer : public ParallelLoopBody {
+	public:
+		//Create a renderer of a scene lit by a linear light pattern into a capture
+		slNativeVirtualRenderer(const slVirtualScene &newVirtualScene, const Mat &newPatternMat, Mat &newCaptureMat) :
+			virtualScene(newVirtualScene),
+			patternMat(newPatternMat),
+			captureMat(newCaptureMat),
+			linearToSRGBTable(createLinearToSRGBTable())
+		{};
+
+		//Render a range of capture rows
+		void operator()(const Range &) const;
+
+		//The camera and projector locations
+		Vec3d cameraLocation, projectorLocation;
+
+		//The half widths of the camera view and projector spot at a distance of 1
+		double cameraTanX, cameraTanY, projectorTan;
+
+		//The light reaching a surface is energy * distance / (distance + d^2), times the surface diffuse intensity
+		double projectorEnergy, projectorDistance, diffuseIntensity;
+
+	private:
+		//The scene to render
+		const slVirtualScene &virtualScene;
+
+		//The projected pattern, as linear light per BGR channel
+		const Mat &patternMat;
+
+		//The capture to render into
+		Mat &captureMat;
+
+		//Converts linear light to 8 bit sRGB
+		vector<uchar> linearToSRGBTable;
+};
+
+//Render a range of capture rows
+void slNativeVirtualRenderer::operator()(const Range &rowRange) const {
+	int width = captureMat.cols;
+	int height = captureMat.rows;
+	int patternWidth = patternMat.cols;
+	int patternHeight = patternMat.rows;
+
+	//The camera looks down -x, with +y to the right and +z up
+	vector<double> rayYs(width);
+
+	for (int x = 0; x < width; x++) {
+		rayYs[x] = ((((x + 0.5) * 2.0) / width) - 1.0) * cameraTanX;
+	}
+
+	for (int y = rowRange.start; y < rowRange.end; y++) {
+		Vec3b *captureRow = captureMat.ptr<Vec3b>(y);
+		double rayZ = (1.0 - (((y + 0.5) * 2.0) / height)) * cameraTanY;
+
+		for (int x = 0; x < width; x++) {
+			Vec3d rayDirection(-1.0, rayYs[x], rayZ);
+			slVirtualSceneHit hit;
+
+			captureRow[x] = Vec3b(0, 0, 0);
+
+			if (!virtualScene.intersect(cameraLocation, rayDirection, DBL_MAX, &hit)) {
+				continue;
+			}
+
+			//The projector shines down -x, with pattern columns along +y and pattern rows down -z
+			Vec3d fromProjector = hit.location - projectorLocation;
+			double projectorDepth = -fromProjector[0];
+
+			if (projectorDepth <= 0.0) {
+				continue;
+			}
+
+			double spotX = fromProjector[1] / (projectorDepth * projectorTan);
+			double spotY = fromProjector[2] / (projectorDepth * projectorTan);
+
+			if (fabs(spotX) > 1.0 || fabs(spotY) > 1.0) {
+				continue;
+			}
+
+			//Surfaces are lit from either side, face the normal towards the camera
+			Vec3d normal = hit.normal;
+
+			if (normal.dot(rayDirection) > 0.0) {
+				normal = -normal;
+			}
+
+			double lightDistance = norm(fromProjector);
+			Vec3d toLight = fromProjector * (-1.0 / lightDistance);
+			double lambert = normal.dot(toLight);
+
+			if (lambert <= 0.0) {
+				continue;
+			}
+
+			//Shadowed if anything is between the surface and the projector
+			double offset = VIRTUAL_SHADOW_OFFSET * (1.0 + lightDistance);
+
+			if (virtualScene.occluded(hit.location + (normal * offset), toLight, lightDistance - offset)) {
+				continue;
+			}
+
+			double intensity = projectorEnergy * (projectorDistance / (projectorDistance + (lightDistance * lightDistance))) * lambert * diffuseIntensity;
+
+			//Bilinear lookup of the pattern, row 0 at the top of the spot
+			double patternX = min(max((((spotX + 1.0) / 2.0) * patternWidth) - 0.5, 0.0), patternWidth - 1.0);
+			double patternY = min(max((((1.0 - spotY) / 2.0) * patternHeight) - 0.5, 0.0), patternHeight - 1.0);
+
+			int patternX0 = (int)patternX;
+			int patternY0 = (int)patternY;
+			int patternX1 = min(patternX0 + 1, patternWidth - 1);
+			int patternY1 = min(patternY0 + 1, patternHeight - 1);
+
+			float weightX = (float)(patternX - patternX0);
+			float weightY = (float)(patternY - patternY0);
+
+			const Vec3f *patternRow0 = patternMat.ptr<Vec3f>(patternY0);
+			const Vec3f *patternRow1 = patternMat.ptr<Vec3f>(patternY1);
+
+			for (int channel = 0; channel < 3; channel++) {
+				float top = patternRow0[patternX0][channel] + ((patternRow0[patternX1][channel] - patternRow0[patternX0][channel]) * weightX);
+				float bottom = patternRow1[patternX0][channel] + ((patternRow1[patternX1][channel] - patternRow1[patternX0][channel]) * weightX);
+				double light = min(intensity * (top + ((bottom - top) * weightY)), 1.0);
+
+				captureRow[x][channel] = linearToSRGBTable[(int)(light * (NATIVE_VIRTUAL_SRGB_TABLE_SIZE - 1) + 0.5)];
+			}
+		}
+	}
+}
+
+//Initialise the infrastucture, the rendered camera has no distortion so there is no calibration
+void slNativeVirtualInfrastructure::init() {
+	if (!virtualScene.load(virtualSceneJSONFilename)) {
+		FATAL("Could not load the virtual scene " << virtualSceneJSONFilename)
+	}
+
+	DB("slNativeVirtualInfrastructure::init() loaded " << virtualScene.getNumberObjects() << " objects from " << virtualSceneJSONFilename)
+}
+
+//Project the structured light implementation pattern and capture it
+Mat slNativeVirtualInfrastructure::projectAndCapture(Mat patternMat) {
+	DB("-> slNativeVirtualInfrastructure::projectAndCapture()")
+
+	//The pattern image is sRGB, light adds up linearly
+	float sRGBToLinearTable[256];
+
+	for (int value = 0; value < 256; value++) {
+		sRGBToLinearTable[value] = (float)sRGBToLinear(value / 255.0);
+	}
+
+	Mat linearPatternMat(patternMat.rows, patternMat.cols, CV_32FC3);
+
+	for (int y = 0; y < patternMat.rows; y++) {
+		Vec3f *linearPatternRow = linearPatternMat.ptr<Vec3f>(y);
+
+		if (patternMat.channels() == 1) {
+			const uchar *patternRow = patternMat.ptr<uchar>(y);
+
+			for (int x = 0; x < patternMat.cols; x++) {
+				float linear = sRGBToLinearTable[patternRow[x]];
+				linearPatternRow[x] = Vec3f(linear, linear, linear);
+			}
+		} else {
+			const Vec3b *patternRow = patternMat.ptr<Vec3b>(y);
+
+			for (int x = 0; x < patternMat.cols; x++) {
+				linearPatternRow[x] = Vec3f(sRGBToLinearTable[patternRow[x][0]], sRGBToLinearTable[patternRow[x][1]], sRGBToLinearTable[patternRow[x][2]]);
+			}
+		}
+	}
+
+	Size cameraResolution = getCameraResolution();
+	Mat captureMat((int)cameraResolution.height, (int)cameraResolution.width, CV_8UC3);
+
+	slNativeVirtualRenderer renderer(virtualScene, linearPatternMat, captureMat);
+
+	//As blender fits the field of view to the longer side of the capture
+	double cameraTan = tan((getCameraHorizontalFOV() * CV_PI) / 360.0);
+
+	if (cameraResolution.width >= cameraResolution.height) {
+		renderer.cameraTanX = cameraTan;
+		renderer.cameraTanY = (cameraTan * cameraResolution.height) / cameraResolution.width;
+	} else {
+		renderer.cameraTanX = (cameraTan * cameraResolution.width) / cameraResolution.height;
+		renderer.cameraTanY = cameraTan;
+	}
+
+	renderer.projectorTan = tan((getProjectorHorizontalFOV() * CV_PI) / 360.0);
+	renderer.cameraLocation = getCameraLocation();
+	renderer.projectorLocation = getProjectorLocation();
+	renderer.projectorEnergy = projectorEnergy;
+	renderer.projectorDistance = projectorDistance;
+	renderer.diffuseIntensity = diffuseIntensity;
+
+	parallel_for_(Range(0, captureMat.rows), renderer);
+
+	DB("<- slNativeVirtualInfrastructure::projectAndCapture()")
 
 	return captureMat;
 }
 
+//Get the virtual scene
+const slVirtualScene &slNativeVirtualInfrastructure::getVirtualScene() {
+	return virtualScene;
+}
+
+//Get the location of the camera
+Vec3d slNativeVirtualInfrastructure::getCameraLocation() {
+	return Vec3d(0.0, -getCameraProjectorSeparation() / 2.0, 0.0);
+}
+
+//Get the location of the projector
+Vec3d slNativeVirtualInfrastructure::getProjectorLocation() {
+	return Vec3d(0.0, getCameraProjectorSeparation() / 2.0, 0.0);
+}
+
 /*
  * slPhysicalInfrastructure
  */ 
@@ -403,6 +974,9 @@ Mat slFileInfrastructure::projectAndCapture(Mat patternMat) {
 //Set default session path
 string slExperiment::sessionPath = string("");
 
+//No thread iteration index outside of a pipelined run
+thread_local int slExperiment::threadIterationIndex = -1;
+
 //Get the current session path
 string slExperiment::getSessionPath() {
 	if (sessionPath.empty()) {
@@ -418,9 +992,9 @@ string slExperiment::getSessionPath() {
 }
 
 //Create an experiment
-slExperiment::slExperiment(slInfrastructure *newlInfrastructure, slImplementation *newImplementation) : infrastructure(newlInfrastructure), implementation(newImplementation) {
+slExperiment::slExperiment(slInfrastructure *newlInfrastructure, slImplementation *newImplementation) : infrastructure(newlInfrastructure), implementation(newImplementation), runMode(SL_RUN_SEQUENTIAL), pipelineQueueSize(DEFAULT_PIPELINE_QUEUE_SIZE), batchSize(DEFAULT_BATCH_SIZE), imageWriter(NULL), imageWriterThreads(DEFAULT_IMAGE_WRITER_THREADS), imageWriterMemoryBudget(DEFAULT_IMAGE_WRITER_MEMORY_BUDGET), numberCapturesDiscarded(0), capturesBytes(0), captureMemoryBudget(DEFAULT_CAPTURE_MEMORY_BUDGET), spillCaptures(true) {
 	path = string("");
-	captures = new vector<Mat>();
+	captures = new deque<Mat>();
 }
 
 //Clean up
@@ -442,6 +1016,34 @@ string slExperiment::getPath() {
 	return path;
 }
 
+//Set how this experiment runs its iterations, and how many iterations can be queued between pipelined stages
+void slExperiment::setRunMode(slRunMode newRunMode, int newPipelineQueueSize) {
+	runMode = newRunMode;
+	pipelineQueueSize = newPipelineQueueSize;
+}
+
+//Get how this experiment runs its iterations
+slRunMode slExperiment::getRunMode() {
+	return runMode;
+}
+
+//Set the number of patterns projected and captured together in a batched run, 0 for all of them
+void slExperiment::setBatchSize(int newBatchSize) {
+	batchSize = newBatchSize;
+}
+
+//Set the number of background threads and the memory budget (bytes) used to write pattern and capture images
+void slExperiment::setImageWriter(int newImageWriterThreads, size_t newImageWriterMemoryBudget) {
+	imageWriterThreads = newImageWriterThreads;
+	imageWriterMemoryBudget = newImageWriterMemoryBudget;
+}
+
+//Set the memory budget (bytes, 0 for no budget) for retained captures, and if captures beyond it are spilled to disk
+void slExperiment::setCaptureMemoryBudget(size_t newCaptureMemoryBudget, bool newSpillCaptures) {
+	captureMemoryBudget = newCaptureMemoryBudget;
+	spillCaptures = newSpillCaptures;
+}
+
 //Run this experiment
 void slExperiment::run() {
 	DB("-> slExperiment::run() infrastructure: " << infrastructure->getName() << " implementation: " << implementation->getIdentifier())
@@ -452,12 +1054,13 @@ void slExperiment::run() {
 
 	//Initialise the infrastructure
 	infrastructure->init();
+	infrastructure->initUndistortion();
 
 	//Inform the implementation the experiment is about to run
 	implementation->preExperimentRun();
 
 	//String paths for the current implementation
-	stringstream patternsPathStream, capturesPathStream, patternFileStream, captureFileStream;
+	stringstream patternsPathStream, capturesPathStream;
 
 	patternsPathStream << getPath() << "patterns";
 	capturesPathStream << getPath() << "captures";
@@ -465,6 +1068,15 @@ void slExperiment::run() {
 	makeDir(patternsPathStream.str().c_str());
 	makeDir(capturesPathStream.str().c_str());
 
+	//Write pattern and capture images in the background
+	imageWriter = new slImageWriter(imageWriterThreads, imageWriterMemoryBudget);
+
+	//Start with no captures
+	captures->clear();
+	numberCapturesDiscarded = 0;
+	capturesBytes = 0;
+	spilledCaptureFilenames.clear();
+
 	//Zero the iteration index
 	iterationIndex = 0;
 
@@ -472,6 +1084,59 @@ void slExperiment::run() {
 	runPreIterations();
 		
 	//Loop until the structured light implementation's pattern generation and capture iterations are completed
+	if (runMode == SL_RUN_PIPELINED) {
+		runPipelinedIterations(patternsPathStream.str(), capturesPathStream.str());
+	} else if (runMode == SL_RUN_BATCHED) {
+		runBatchedIterations(patternsPathStream.str(), capturesPathStream.str());
+	} else {
+		runSequentialIterations(patternsPathStream.str(), capturesPathStream.str());
+	}
+
+	//Run after all iterations have completed
+	runPostIterations();
+
+
+		
+	//Allow the implementation to post process after the iterations
+	DB("About to implementation->postIterationsProcess()...")
+
+	//Run before the implementation processes after all the iterations
+	runPreImplementationPostIterationsProcess();
+
+	implementation->postIterationsProcess();
+
+	//Run after the implementation processes after all the iterations
+	runPostImplementationPostIterationsProcess();
+
+	DB("implementation->postIterationsProcess() complete.")
+
+
+
+	//Wait for the pattern and capture images to be written
+	int numberImageWriteFailures = imageWriter->flush();
+
+	if (numberImageWriteFailures > 0) {
+		DB("WARNING: " << numberImageWriteFailures << " pattern and capture images could not be written")
+	}
+
+	delete imageWriter;
+	imageWriter = NULL;
+
+	//Inform the implementation and infrastructure the experiment has completed running
+	implementation->postExperimentRun();
+	infrastructure->postExperimentRun();
+
+	//Unset the current experiments of the infrastructre and implementation
+	infrastructure->experiment = NULL;
+	implementation->experiment = NULL;
+
+	DB("<- slExperiment::end()")
+}
+
+//Run the iterations one stage after the other
+void slExperiment::runSequentialIterations(string patternsPath, string capturesPath) {
+	stringstream patternFileStream, captureFileStream;
+
 	while (implementation->hasMoreIterations()) {
 		//Run before this iteration begins
 		runPreIteration();
@@ -499,10 +1164,10 @@ void slExperiment::run() {
 
 
 		//Create current pattern file path
-		patternFileStream << patternsPathStream.str() << OS_SEP << "pattern_" << iterationIndex << ".png";
+		patternFileStream << patternsPath << OS_SEP << "pattern_" << iterationIndex << ".png";
 
 		//Save the pattern to the implementation's patterns
-		imwrite(patternFileStream.str(), patternMat);
+		imageWriter->write(patternFileStream.str(), patternMat);
 
 
 
@@ -518,18 +1183,17 @@ void slExperiment::run() {
 		runPostProjectAndCapture();
 
 		//Undistort the capture
-		Mat undistortedCaptureMat;
-		undistort(captureMat, undistortedCaptureMat, infrastructure->intrinsicMat, infrastructure->distortionMat);
+		Mat undistortedCaptureMat = infrastructure->undistortCapture(captureMat);
 
 		DB("infrastructure->projectAndCapture() complete.")
 
 
 
 		//Create current capture file path
-		captureFileStream << capturesPathStream.str() << OS_SEP << "capture_" << iterationIndex << ".png";
+		captureFileStream << capturesPath << OS_SEP << "capture_" << iterationIndex << ".png";
 
 		//Save the capture to the implementation's captures
-		imwrite(captureFileStream.str(), undistortedCaptureMat);
+		imageWriter->write(captureFileStream.str(), undistortedCaptureMat);
 
 
 
@@ -560,35 +1224,264 @@ void slExperiment::run() {
 		iterationIndex++;
 
 	}
+}
 
-	//Run after all iterations have completed
-	runPostIterations();
+//Run the iterations with pattern generation, projection/capture and processing overlapped on separate threads
+void slExperiment::runPipelinedIterations(string patternsPath, string capturesPath) {
+	slBoundedQueue<slPipelineItem> patternQueue(pipelineQueueSize);
+	slBoundedQueue<slPipelineItem> captureQueue(pipelineQueueSize);
 
+	//Projection and capture stays on this thread, as GUI based infrastructures need the main thread
+	thread patternGenerationThread(&slExperiment::runPipelinedPatternGeneration, this, patternsPath, &patternQueue);
+	thread captureProcessingThread(&slExperiment::runPipelinedCaptureProcessing, this, capturesPath, &captureQueue);
 
-		
-	//Allow the implementation to post process after the iterations
-	DB("About to implementation->postIterationsProcess()...")
+	slPipelineItem item;
 
-	//Run before the implementation processes after all the iterations
-	runPreImplementationPostIterationsProcess();
+	while (patternQueue.pop(item)) {
+		slIterationScope iterationScope(item.iterationIndex);
 
-	implementation->postIterationsProcess();
+		//Capture the implementation's pattern using the current infrastructure
+		DB("About to infrastructure->projectAndCapture() for iteration #" << item.iterationIndex << "...")
 
-	//Run after the implementation processes after all the iterations
-	runPostImplementationPostIterationsProcess();
+		{
+			lock_guard<mutex> hookLock(hookMutex);
 
-	DB("implementation->postIterationsProcess() complete.")
+			//Run before pattern is projected and captured
+			runPreProjectAndCapture();
+		}
 
+		item.captureMat = infrastructure->projectAndCapture(item.patternMat);
 
+		{
+			lock_guard<mutex> hookLock(hookMutex);
 
-	//Inform the implementation the experiment has completed running
-	implementation->postExperimentRun();
+			//Run after pattern is projected and captured
+			runPostProjectAndCapture();
+		}
 
-	//Unset the current experiments of the infrastructre and implementation
-	infrastructure->experiment = NULL;
-	implementation->experiment = NULL;
+		DB("infrastructure->projectAndCapture() for iteration #" << item.iterationIndex << " complete.")
 
-	DB("<- slExperiment::end()")
+		item.patternMat.release();
+		captureQueue.push(item);
+	}
+
+	captureQueue.close();
+
+	patternGenerationThread.join();
+	captureProcessingThread.join();
+}
+
+//Generate the pattern of each iteration for a pipelined run
+void slExperiment::runPipelinedPatternGeneration(string patternsPath, slBoundedQueue<slPipelineItem> *patternQueue) {
+	stringstream patternFileStream;
+
+	for (int patternIterationIndex = 0; ; patternIterationIndex++) {
+		slIterationScope iterationScope(patternIterationIndex);
+
+		if (!implementation->hasMoreIterations()) {
+			break;
+		}
+
+		slPipelineItem item;
+		item.iterationIndex = patternIterationIndex;
+
+		//Generate the implementation's pattern
+		DB("About to implementation->generatePattern() for iteration #" << patternIterationIndex << "...")
+
+		{
+			lock_guard<mutex> hookLock(hookMutex);
+
+			//Run before this iteration begins
+			runPreIteration();
+
+			//Run before a pattern is generated
+			runPrePatternGeneration();
+		}
+
+		item.patternMat = implementation->generatePattern();
+
+		{
+			lock_guard<mutex> hookLock(hookMutex);
+
+			//Run after a pattern is generated
+			runPostPatternGeneration();
+		}
+
+		DB("implementation->generatePattern() for iteration #" << patternIterationIndex << " complete.")
+
+		//Save the pattern to the implementation's patterns
+		patternFileStream.str("");
+		patternFileStream << patternsPath << OS_SEP << "pattern_" << patternIterationIndex << ".png";
+
+		imageWriter->write(patternFileStream.str(), item.patternMat);
+
+		if (!patternQueue->push(item)) {
+			break;
+		}
+	}
+
+	patternQueue->close();
+}
+
+//Process the capture of each iteration for a pipelined run
+void slExperiment::runPipelinedCaptureProcessing(string capturesPath, slBoundedQueue<slPipelineItem> *captureQueue) {
+	stringstream captureFileStream;
+	slPipelineItem item;
+
+	while (captureQueue->pop(item)) {
+		slIterationScope iterationScope(item.iterationIndex);
+
+		//Undistort the capture
+		Mat undistortedCaptureMat = infrastructure->undistortCapture(item.captureMat);
+
+		//Save the capture to the implementation's captures
+		captureFileStream.str("");
+		captureFileStream << capturesPath << OS_SEP << "capture_" << item.iterationIndex << ".png";
+
+		imageWriter->write(captureFileStream.str(), undistortedCaptureMat);
+
+		//Allow the implementation to process the capture
+		DB("About to implementation->processCapture() for iteration #" << item.iterationIndex << "...")
+
+		{
+			lock_guard<mutex> hookLock(hookMutex);
+
+			//Run before the implementation processes this capture
+			runPreProcessCapture();
+		}
+
+		implementation->processCapture(undistortedCaptureMat);
+
+		{
+			lock_guard<mutex> hookLock(hookMutex);
+
+			//Run after the implementation processes this capture
+			runPostProcessCapture();
+
+			//Run after this iteration has completed
+			runPostIteration();
+		}
+
+		DB("Iteration #" << item.iterationIndex << " complete.")
+
+		//Captures are processed in order, so this is the number of completed iterations
+		iterationIndex = item.iterationIndex + 1;
+	}
+}
+
+//Run the iterations by generating a batch of patterns, projecting and capturing them together, then processing the captures in order
+void slExperiment::runBatchedIterations(string patternsPath, string capturesPath) {
+	stringstream patternFileStream, captureFileStream;
+	bool moreIterations = true;
+
+	while (moreIterations) {
+		int firstIterationIndex = iterationIndex;
+		vector<Mat> patternMats;
+
+		//Generate the implementation's patterns for this batch
+		DB("About to implementation->generatePattern() from iteration #" << firstIterationIndex << "...")
+
+		while (batchSize <= 0 || (int)patternMats.size() < batchSize) {
+			slIterationScope iterationScope(firstIterationIndex + (int)patternMats.size());
+
+			moreIterations = implementation->hasMoreIterations();
+
+			if (!moreIterations) {
+				break;
+			}
+
+			//Run before this iteration begins
+			runPreIteration();
+
+			//Run before a pattern is generated
+			runPrePatternGeneration();
+
+			Mat patternMat = implementation->generatePattern();
+
+			//Run after a pattern is generated
+			runPostPatternGeneration();
+
+			//Save the pattern to the implementation's patterns
+			patternFileStream.str("");
+			patternFileStream << patternsPath << OS_SEP << "pattern_" << getIterationIndex() << ".png";
+
+			imageWriter->write(patternFileStream.str(), patternMat);
+
+			patternMats.push_back(patternMat);
+		}
+
+		if (patternMats.empty()) {
+			break;
+		}
+
+		DB("implementation->generatePattern() for " << patternMats.size() << " iterations complete.")
+
+
+
+		//Capture the implementation's patterns using the current infrastructure
+		DB("About to infrastructure->projectAndCaptureBatch()...")
+
+		//Run before the patterns are projected and captured
+		runPreProjectAndCapture();
+
+		vector<Mat> captureMats = infrastructure->projectAndCaptureBatch(patternMats, firstIterationIndex);
+
+		//Run after the patterns are projected and captured
+		runPostProjectAndCapture();
+
+		if (captureMats.size() != patternMats.size()) {
+			FATAL("Expected " << patternMats.size() << " captures from infrastructure->projectAndCaptureBatch(), got " << captureMats.size())
+		}
+
+		patternMats.clear();
+
+		DB("infrastructure->projectAndCaptureBatch() complete.")
+
+
+
+		//Process the captures in the order of their iterations
+		for (size_t captureIndex = 0; captureIndex < captureMats.size(); captureIndex++) {
+			//Undistort the capture
+			Mat undistortedCaptureMat = infrastructure->undistortCapture(captureMats[captureIndex]);
+			captureMats[captureIndex].release();
+
+			//Save the capture to the implementation's captures
+			captureFileStream.str("");
+			captureFileStream << capturesPath << OS_SEP << "capture_" << iterationIndex << ".png";
+
+			imageWriter->write(captureFileStream.str(), undistortedCaptureMat);
+
+			//Allow the implementation to process the capture
+			DB("About to implementation->processCapture() for iteration #" << iterationIndex << "...")
+
+			//Run before the implementation processes this capture
+			runPreProcessCapture();
+
+			implementation->processCapture(undistortedCaptureMat);
+
+			//Run after the implementation processes this capture
+			runPostProcessCapture();
+
+			DB("Iteration #" << iterationIndex << " complete.")
+
+			//Run after this iteration has completed
+			runPostIteration();
+
+			//Increment the iteration index
+			iterationIndex++;
+		}
+	}
+}
+
+//Store a batch of depth results of this experiment, such as a row
+void slExperiment::storeResults(const vector<slDepthExperimentResult> &results) {
+	//storeResult is not expected to be thread safe
+	lock_guard<mutex> lock(storeResultMutex);
+
+	for (vector<slDepthExperimentResult>::const_iterator result = results.begin(); result != results.end(); ++result) {
+		slDepthExperimentResult resultToStore(*result);
+		storeResult(&resultToStore);
+	}
 }
 
 //Get the current infrastructure
@@ -603,27 +1496,87 @@ slImplementation *slExperiment::getImplementation() {
 
 //Get the current pattern generation and capture iteration index
 int slExperiment::getIterationIndex() {
+	//Pipelined stages each see the index of the iteration they are working on
+	if (threadIterationIndex >= 0) {
+		return threadIterationIndex;
+	}
+
 	return iterationIndex;
 }
 
 //Store the capture
 void slExperiment::storeCapture(Mat captureMat) {
 	captures->push_back(captureMat);
+	capturesBytes += captureMat.total() * captureMat.elemSize();
+
+	//Only keep the captures the implementation reads back
+	int numberCapturesRetained = implementation->getNumberCapturesRetained();
+
+	if (numberCapturesRetained != RETAIN_ALL_CAPTURES) {
+		while ((int)captures->size() > numberCapturesRetained) {
+			discardOldestCapture(false);
+		}
+	}
+
+	//Keep the retained captures within the memory budget
+	if (captureMemoryBudget > 0 && capturesBytes > captureMemoryBudget && captures->size() > 1) {
+		if (spillCaptures) {
+			while (capturesBytes > captureMemoryBudget && captures->size() > 1) {
+				discardOldestCapture(true);
+			}
+		} else {
+			DB("WARNING: retained captures (" << capturesBytes << " bytes) exceed the capture memory budget (" << captureMemoryBudget << " bytes)")
+		}
+	}
+}
+
+//Drop the oldest retained capture, optionally spilling it to disk first
+void slExperiment::discardOldestCapture(bool spill) {
+	Mat captureMat = captures->front();
+
+	if (spill) {
+		stringstream spilledCapturesPathStream, spilledCaptureFileStream;
+
+		spilledCapturesPathStream << getPath() << "spilled_captures";
+		makeDir(spilledCapturesPathStream.str().c_str());
+
+		spilledCaptureFileStream << spilledCapturesPathStream.str() << OS_SEP << "capture_" << numberCapturesDiscarded << ".png";
+
+		if (!imwrite(spilledCaptureFileStream.str(), captureMat)) {
+			FATAL("Could not spill capture to file \"" << spilledCaptureFileStream.str() << "\"")
+		}
+
+		spilledCaptureFilenames[numberCapturesDiscarded] = spilledCaptureFileStream.str();
+	}
+
+	capturesBytes -= captureMat.total() * captureMat.elemSize();
+	captures->pop_front();
+	numberCapturesDiscarded++;
 }
 
 //Get the capture at an index
 Mat slExperiment::getCaptureAt(int index) {
-	return captures->at(index);
+	if (index >= numberCapturesDiscarded) {
+		return captures->at(index - numberCapturesDiscarded);
+	}
+
+	map<int, string>::iterator spilledCaptureFilename = spilledCaptureFilenames.find(index);
+
+	if (spilledCaptureFilename == spilledCaptureFilenames.end()) {
+		FATAL("Capture #" << index << " is not retained, check " << implementation->getIdentifier() << "::getNumberCapturesRetained()")
+	}
+
+	return imread(spilledCaptureFilename->second);
 }
 
 //Get the last capture
 Mat slExperiment::getLastCapture() {
-	return captures->back();
+	return getCaptureAt(getNumberCaptures() - 1);
 }
 
-//Get the number of captures
+//Get the number of captures stored, including those no longer retained
 int slExperiment::getNumberCaptures() {
-	return captures->size();
+	return numberCapturesDiscarded + captures->size();
 }
 
 //Get a meaningful identifier of this experiment
@@ -671,75 +1624,206 @@ if (temp) {
 }
 
 /*
- * slDepthExperiment
+ * slImageWriter
  */ 
 
-//Create a depth experiment
-slDepthExperiment::slDepthExperiment(slInfrastructure *newlInfrastructure, slImplementation *newImplementation) : slExperiment(newlInfrastructure, newImplementation)/*, depthData(NULL)*/ {
+//Create an image writer with a number of threads and a budget (bytes) for images waiting to be written
+slImageWriter::slImageWriter(int newNumberThreads, size_t newMemoryBudget): memoryBudget(newMemoryBudget), pendingBytes(0), numberWriting(0), stopping(false) {
+	if (newNumberThreads < 1) {
+		newNumberThreads = 1;
+	}
+
+	for (int threadIndex = 0; threadIndex < newNumberThreads; threadIndex++) {
+		workers.push_back(thread(&slImageWriter::runWorker, this));
+	}
+}
+
+//Clean up, waiting for queued images to be written
+slImageWriter::~slImageWriter() {
+	flush();
+
+	{
+		lock_guard<mutex> lock(writerMutex);
+		stopping = true;
+		writeQueued.notify_all();
+	}
+
+	for (vector<thread>::iterator worker = workers.begin(); worker != workers.end(); ++worker) {
+		worker->join();
+	}
+}
+
+//Queue an image to be written, waiting while the memory budget is used up
+void slImageWriter::write(string filename, Mat imageMat) {
+	size_t imageBytes = getImageBytes(imageMat);
+
+	unique_lock<mutex> lock(writerMutex);
+
+	//An image larger than the whole budget is still written, once nothing else is pending
+	writeCompleted.wait(lock, [&] { return pendingBytes == 0 || pendingBytes + imageBytes <= memoryBudget; });
+
+	slImageWrite imageWrite;
+	imageWrite.filename = filename;
+	imageWrite.imageMat = imageMat;
+
+	queuedWrites.push_back(imageWrite);
+	pendingBytes += imageBytes;
+
+	writeQueued.notify_one();
+}
+
+//Wait for all queued images to be written, reporting and returning the number that could not be written
+int slImageWriter::flush() {
+	unique_lock<mutex> lock(writerMutex);
+	writeCompleted.wait(lock, [this] { return queuedWrites.empty() && numberWriting == 0; });
+
+	for (vector<string>::iterator failedFilename = failedFilenames.begin(); failedFilename != failedFilenames.end(); ++failedFilename) {
+		DB("WARNING: could not write image file \"" << *failedFilename << "\"")
+	}
+
+	int numberFailed = failedFilenames.size();
+	failedFilenames.clear();
+
+	return numberFailed;
+}
+
+//Write queued images until stopped
+void slImageWriter::runWorker() {
+	unique_lock<mutex> lock(writerMutex);
+
+	while (true) {
+		writeQueued.wait(lock, [this] { return stopping || !queuedWrites.empty(); });
+
+		if (queuedWrites.empty()) {
+			return;
+		}
+
+		slImageWrite imageWrite = queuedWrites.front();
+		queuedWrites.pop_front();
+		numberWriting++;
+
+		lock.unlock();
+
+		bool written = false;
+
+		try {
+			written = imwrite(imageWrite.filename, imageWrite.imageMat);
+		} catch (cv::Exception &exception) {
+			DB("WARNING: " << exception.what())
+		}
+
+		lock.lock();
+
+		if (!written) {
+			failedFilenames.push_back(imageWrite.filename);
+		}
+
+		pendingBytes -= getImageBytes(imageWrite.imageMat);
+		numberWriting--;
+
+		writeCompleted.notify_all();
+	}
+}
+
+//The size of an image in bytes
+size_t slImageWriter::getImageBytes(const Mat &imageMat) {
+	return imageMat.total() * imageMat.elemSize();
+}
+
+/*
+ * slIterationScope
+ */ 
+
+//Set the iteration index of the current thread
+slIterationScope::slIterationScope(int iterationIndex): previousIterationIndex(slExperiment::threadIterationIndex) {
+	slExperiment::threadIterationIndex = iterationIndex;
+}
+
+//Restore the previous iteration index of the current thread
+slIterationScope::~slIterationScope() {
+	slExperiment::threadIterationIndex = previousIterationIndex;
+}
+
 /*
-	//numDepthDataValues = infrastructure->getProjectorResolution().width * infrastructure->getCameraResolution().height;
-	numDepthDataValues = implementation->getPatternWidth() * infrastructure->getCameraResolution().height;
+ * slDepthGrid
+ */ 
 
-	depthDataValued = new bool[numDepthDataValues];
-	depthData = new double[numDepthDataValues];
+//Resize the grid, clearing all depth values
+void slDepthGrid::resize(int newWidth, int newHeight) {
+	width = newWidth > 0 ? newWidth : 0;
+	height = newHeight > 0 ? newHeight : 0;
+	wordsPerRow = (width + 63) >> 6;
 
-	for (int index = 0; index < numDepthDataValues; index++) {
-		depthDataValued[index] = false;
-		depthData[index] = 0.0;
+	depth.assign((size_t)width * height, 0.0);
+	valued.assign((size_t)wordsPerRow * height, 0);
+}
+
+//Clear all depth values
+void slDepthGrid::clear() {
+	fill(depth.begin(), depth.end(), 0.0);
+	fill(valued.begin(), valued.end(), 0);
+}
+
+//Count the number of values set in the first columns of a row
+int slDepthGrid::countValued(int y, int numberColumns) const {
+	if ((unsigned int)y >= (unsigned int)height) {
+		return 0;
 	}
-*/
-	int width = implementation->getPatternWidth();
-	int height = infrastructure->getCameraResolution().height;
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			depthDataValued[x][y] = false;
-			depthData[x][y] = 0.0;
+	if (numberColumns > width) {
+		numberColumns = width;
+	}
+
+	const uint64_t *valuedRow = getValuedRow(y);
+	int fullWords = numberColumns >> 6;
+	int count = 0;
+
+	for (int word = 0; word < fullWords; word++) {
+		for (uint64_t bits = valuedRow[word]; bits != 0; bits &= bits - 1) {
+			count++;
 		}
 	}
+
+	for (int x = fullWords << 6; x < numberColumns; x++) {
+		count += isValued(valuedRow, x);
+	}
+
+	return count;
 }
 
-//Clean up
-slDepthExperiment::~slDepthExperiment() {
 /*
-	if (depthData != NULL) {
-		delete[] depthDataValued;
-		delete[] depthData;
+ * slDepthExperiment
+ */ 
+
+//Create a depth experiment
+slDepthExperiment::slDepthExperiment(slInfrastructure *newlInfrastructure, slImplementation *newImplementation) : slExperiment(newlInfrastructure, newImplementation) {
+	//Results are stored at the pattern x scaled to the projector width, so cover both
+	int width = (int)implementation->getPatternWidth();
+	int projectorWidth = infrastructure->getProjectorResolution().width;
+
+	if (projectorWidth > width) {
+		width = projectorWidth;
 	}
-*/
+
+	depthGrid.resize(width, infrastructure->getCameraResolution().height);
+}
+
+//Clean up
+slDepthExperiment::~slDepthExperiment() {
 }
 
 //Store a result of this experiment
 void slDepthExperiment::storeResult(slExperimentResult *experimentResult) {
 	slDepthExperimentResult *depthExperimentResult = (slDepthExperimentResult *)experimentResult;
-/*
-	//int arrayOffset = (depthExperimentResult->y * infrastructure->getProjectorResolution().width) + depthExperimentResult->x;
-	int arrayOffset = (depthExperimentResult->y * implementation->getPatternWidth()) + depthExperimentResult->x;
-	
-	depthDataValued[arrayOffset] = false;
-	//depthData[arrayOffset] = depthExperimentResult->z;
-*/
-	depthDataValued[depthExperimentResult->x][depthExperimentResult->y] = true;
-	depthData[depthExperimentResult->x][depthExperimentResult->y] = depthExperimentResult->z;
-}
-/*
-//Get the number of depth data values
-int slDepthExperiment::getNumDepthDataValues() {
-	return numDepthDataValues;
-}
-*/
-//Check if depth data value has been set
-//bool slDepthExperiment::isDepthDataValued(int index) {
-bool slDepthExperiment::isDepthDataValued(int x, int y) {
-	//return depthDataValued[index];
-	return depthDataValued[x][y];
+
+	depthGrid.set(depthExperimentResult->x, depthExperimentResult->y, depthExperimentResult->z);
 }
 
-//Get depth data value
-//double slDepthExperiment::getDepthData(int index) {
-double slDepthExperiment::getDepthData(int x, int y) {
-	//return depthData[index];
-	return depthData[x][y];
+//Store a batch of depth results of this experiment directly into the depth grid
+void slDepthExperiment::storeResults(const vector<slDepthExperimentResult> &results) {
+	for (vector<slDepthExperimentResult>::const_iterator result = results.begin(); result != results.end(); ++result) {
+		depthGrid.set(result->x, result->y, result->z);
+	}
 }
 
 /*
@@ -757,53 +1841,76 @@ slDepthExperimentResult::slDepthExperimentResult(int newX, int newY, double newZ
 //Create a speed experiment
 slSpeedExperiment::slSpeedExperiment(slInfrastructure *newlInfrastructure, slImplementation *newImplementation) : 
 	slExperiment(newlInfrastructure, newImplementation),
-	previousClock(0), 
-	totalClock(0) {
+	totalTime(chrono::steady_clock::duration::zero()) {
+}
+
+//Stages are timed with wall time, as CPU time adds up every thread. A
+//pipelined or batched run's stages overlap, so only the whole run is timed.
+void slSpeedExperiment::startStage() {
+	if (getRunMode() == SL_RUN_SEQUENTIAL) {
+		stageStart = chrono::steady_clock::now();
+	}
+}
+
+void slSpeedExperiment::endStage() {
+	if (getRunMode() == SL_RUN_SEQUENTIAL) {
+		totalTime += chrono::steady_clock::now() - stageStart;
+	}
+}
+
+//Run before all iterations begin
+void slSpeedExperiment::runPreIterations() {
+	totalTime = chrono::steady_clock::duration::zero();
+	runStart = chrono::steady_clock::now();
 }
 
 //Run before a pattern is generated
 void slSpeedExperiment::runPrePatternGeneration() {
-	previousClock = clock();
+	startStage();
 }
 
 //Run after a pattern is generated
 void slSpeedExperiment::runPostPatternGeneration() {
-	totalClock += clock() - previousClock;
+	endStage();
 }
 
 //Run before pattern is projected and captured
 void slSpeedExperiment::runPreProjectAndCapture() {
-	previousClock = clock();
+	startStage();
 }
 
 //Run after pattern is projected and captured
 void slSpeedExperiment::runPostProjectAndCapture() {
-	totalClock += clock() - previousClock;
+	endStage();
 }
 
-//Run before the implementation processes this iteration
-void slSpeedExperiment::runPreIterationProcess() {
-	previousClock = clock();
+//Run before the implementation processes a capture
+void slSpeedExperiment::runPreProcessCapture() {
+	startStage();
 }
 
-//Run after the implementation processes this iteration
-void slSpeedExperiment::runPostIterationProcess() {
-	totalClock += clock() - previousClock;
+//Run after the implementation processes a capture
+void slSpeedExperiment::runPostProcessCapture() {
+	endStage();
 }
 
 //Run before the implementation processes after all the iterations
-void slSpeedExperiment::runPrePostIterationsProcess() {
-	previousClock = clock();
+void slSpeedExperiment::runPreImplementationPostIterationsProcess() {
+	startStage();
 }
 
 //Run after the implementation processes after all the iterations
-void slSpeedExperiment::runPostPostIterationsProcess() {
-	totalClock += clock() - previousClock;
+void slSpeedExperiment::runPostImplementationPostIterationsProcess() {
+	if (getRunMode() == SL_RUN_SEQUENTIAL) {
+		endStage();
+	} else {
+		totalTime = chrono::steady_clock::now() - runStart;
+	}
 }
 
-//Get the total clock value
-clock_t slSpeedExperiment::getTotalClock() {
-	return totalClock;
+//Get the total wall time taken, in seconds
+double slSpeedExperiment::getTotalSeconds() {
+	return chrono::duration<double>(totalTime).count();
 }
 
 /*
@@ -864,11 +1971,11 @@ void slSpeedMetric::compareExperimentAgainstReference(slExperiment *experiment,
 	slSpeedExperiment *referenceSpeedExperiment = dynamic_cast<slSpeedExperiment *>(referenceExperiment);
 	slSpeedExperiment *speedExperiment = dynamic_cast<slSpeedExperiment *>(experiment);
 
-	double speedDifference = referenceSpeedExperiment->getTotalClock() - speedExperiment->getTotalClock();
+	double speedDifference = referenceSpeedExperiment->getTotalSeconds() - speedExperiment->getTotalSeconds();
 
-	DB("Ref: " << referenceSpeedExperiment->getIdentifier() << " totalClock: " << referenceSpeedExperiment->getTotalClock() << " (" << ((double)referenceSpeedExperiment->getTotalClock() / (double)CLOCKS_PER_SEC) << " seconds)")
-	DB(speedExperiment->getIdentifier() << " totalClock: " << speedExperiment->getTotalClock() << " (" << ((double)speedExperiment->getTotalClock() / (double)CLOCKS_PER_SEC) << " seconds)")
-	DB("Difference totalClock: " << speedDifference << " (" << (speedDifference / (double)CLOCKS_PER_SEC) << " seconds)")
+	DB("Ref: " << referenceSpeedExperiment->getIdentifier() << " total: " << referenceSpeedExperiment->getTotalSeconds() << " seconds")
+	DB(speedExperiment->getIdentifier() << " total: " << speedExperiment->getTotalSeconds() << " seconds")
+	DB("Difference: " << speedDifference << " seconds")
 }
 
 /*
@@ -929,49 +2036,31 @@ void slAccuracyMetric::compareExperimentAgainstReference(slExperiment *experimen
 	//int numPatternColumns = depthExperiment->getImplementation()->getPatternWidth();
 	int cameraHeight = cameraResolution.height;
 
-//	double *depthDifferences = new double[depthExperiment->getNumDepthDataValues()];
-	map<int, map<int, double> > depthDifferences;	
+	const slDepthGrid &referenceDepthGrid = referenceDepthExperiment->getDepthGrid();
+	const slDepthGrid &depthGrid = depthExperiment->getDepthGrid();
+
+	vector<double> depthDifferences;
 	double maxDepthDifference = numeric_limits<double>::min();
 	double minDepthDifference = numeric_limits<double>::max();
-/*
-	for (int depthDataIndex = 0; depthDataIndex < depthExperiment->getNumDepthDataValues(); depthDataIndex++) {
-		if (referenceDepthExperiment->isDepthDataValued(depthDataIndex) && depthExperiment->isDepthDataValued(depthDataIndex)) {
-			depthDifferences[depthDataIndex] = referenceDepthExperiment->getDepthData(depthDataIndex) - depthExperiment->getDepthData(depthDataIndex);
 
-			if (depthDifferences[depthDataIndex] < 0) {
-				depthDifferences[depthDataIndex] = -depthDifferences[depthDataIndex];
-			}
+	for (int y = 0; y < cameraHeight; y++) {
+		const double *referenceDepthRow = referenceDepthGrid.getDepthRow(y);
+		const double *depthRow = depthGrid.getDepthRow(y);
+		const uint64_t *referenceValuedRow = referenceDepthGrid.getValuedRow(y);
+		const uint64_t *valuedRow = depthGrid.getValuedRow(y);
 
-			if (depthDifferences[depthDataIndex] > maxDepthDifference) {
-				maxDepthDifference = depthDifferences[depthDataIndex];
-			}	
-		}
-	}
-*/
-	for (int x = 0; x < numPatternColumns; x++) {
-		for (int y = 0; y < cameraHeight; y++) {
-/*
-			if (referenceDepthExperiment->isDepthDataValued(x, y)) {
-				DB("*** RC VALUED x: " << x << " y: " << y << " ***")
-			}
-			if (depthExperiment->isDepthDataValued(x, y)) {
-				DB("*** SL VALUED x: " << x << " y: " << y << " ***")
-			}
-*/
-			if (referenceDepthExperiment->isDepthDataValued(x, y) && depthExperiment->isDepthDataValued(x, y)) {
-//				DB("*** BOTH VALUED ***")
-				depthDifferences[x][y] = referenceDepthExperiment->getDepthData(x, y) - depthExperiment->getDepthData(x, y);
-/*
-				if (depthDifferences[x][y] < 0) {
-					depthDifferences[x][y] = -depthDifferences[x][y];
-				}
-*/
-				if (depthDifferences[x][y] > maxDepthDifference) {
-					maxDepthDifference = depthDifferences[x][y];
+		for (int x = 0; x < numPatternColumns; x++) {
+			if (slDepthGrid::isValued(referenceValuedRow, x) && slDepthGrid::isValued(valuedRow, x)) {
+				double depthDifference = referenceDepthRow[x] - depthRow[x];
+
+				if (depthDifference > maxDepthDifference) {
+					maxDepthDifference = depthDifference;
 				}	
-				if (depthDifferences[x][y] < minDepthDifference) {
-					minDepthDifference = depthDifferences[x][y];
+				if (depthDifference < minDepthDifference) {
+					minDepthDifference = depthDifference;
 				}	
+
+				depthDifferences.push_back(depthDifference);
 			}
 		}
 	}
@@ -979,35 +2068,13 @@ void slAccuracyMetric::compareExperimentAgainstReference(slExperiment *experimen
 	double binSize = 0.001;
 	//double binSize = 0.2;
 	//int histogramSize = (int)ceil(maxDepthDifference / binSize);
-	int histogramSize = (int)ceil((maxDepthDifference - minDepthDifference) / binSize);
+	int histogramSize = depthDifferences.empty() ? 0 : (int)floor((maxDepthDifference - minDepthDifference) / binSize) + 1;
 	//DB("maxDepthDifference: " << maxDepthDifference << " minDepthDifference: " << minDepthDifference)
-	int histogram[histogramSize];
+	vector<int> histogram(histogramSize, 0);
 
-	for (int histogramIndex = 0; histogramIndex < histogramSize; histogramIndex++) {
-		histogram[histogramIndex] = 0;
+	for (vector<double>::iterator depthDifference = depthDifferences.begin(); depthDifference != depthDifferences.end(); ++depthDifference) {
+		histogram[(int)floor((*depthDifference - minDepthDifference) / binSize)]++;
 	}
-//	DB("histogramSize: " << histogramSize)
-/*
-	for (int depthDataIndex = 0; depthDataIndex < depthExperiment->getNumDepthDataValues(); depthDataIndex++) {
-		if (referenceDepthExperiment->isDepthDataValued(depthDataIndex) && depthExperiment->isDepthDataValued(depthDataIndex)) {
-			double depthDifference = depthDifferences[depthDataIndex] / binSize;
-
-			histogram[(int)floor(depthDifference)]++;
-		}
-	}
-*/
-	for (int x = 0; x < numPatternColumns; x++) {
-		for (int y = 0; y < cameraHeight; y++) {
-			if (referenceDepthExperiment->isDepthDataValued(x, y) && depthExperiment->isDepthDataValued(x, y)) {
-				//double depthDifference = depthDifferences[x][y] / binSize;
-				double depthDifference = (depthDifferences[x][y] - minDepthDifference) / binSize;
-
-				histogram[(int)floor(depthDifference)]++;
-			}
-		}
-	}
-
-	//delete [] depthDifferences;
 
 	stringstream historgramFileStream;
 	historgramFileStream << slExperiment::getSessionPath() << referenceDepthExperiment->getIdentifier() << "_vs_" << depthExperiment->getIdentifier() << "_accuracy_histogram.csv";
@@ -1048,16 +2115,9 @@ void slResolutionMetric::compareExperimentAgainstReference(slExperiment *experim
 	int referenceDataValues = 0;
 	int dataValues = 0;
 
-	for (int x = 0; x < numPatternColumns; x++) {
-		for (int y = 0; y < cameraHeight; y++) {
-			if (referenceDepthExperiment->isDepthDataValued(x, y)) {
-				referenceDataValues++;
-			}
-			
-			if (depthExperiment->isDepthDataValued(x, y)) {
-				dataValues++;
-			}
-		}
+	for (int y = 0; y < cameraHeight; y++) {
+		referenceDataValues += referenceDepthExperiment->getDepthGrid().countValued(y, numPatternColumns);
+		dataValues += depthExperiment->getDepthGrid().countValued(y, numPatternColumns);
 	}
 
 	int resolutionDifference = referenceDataValues - dataValues;
@@ -30,10 +30,19 @@
 #include <iterator>
 #include <fstream>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctime>
+#include <chrono>
 #include <sys/stat.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <opencv2/opencv.hpp>
 
+#include "slVirtualScene.h"
+
 //Physical camera/projector calibration filename/XML names
 #define INTRINSIC_NAME				"intrinsic"
 #define DISTORTION_NAME				"distortion"
@@ -58,6 +67,33 @@
 //Default projection and capture wait (pause) time in milliseconds
 #define DEFAULT_WAIT_TIME			1000
 
+//Default time in seconds to wait for a Blender render server to start and connect
+#define DEFAULT_RENDER_SERVER_TIMEOUT		120
+
+//Default number of Blender processes rendering a batch of patterns concurrently
+#define DEFAULT_RENDER_PROCESSES		4
+
+//Default native virtual projector energy, falloff distance and surface diffuse intensity, as for the Blender spot lamp and default material
+#define DEFAULT_VIRTUAL_PROJECTOR_ENERGY	500
+#define DEFAULT_VIRTUAL_PROJECTOR_DISTANCE	25
+#define DEFAULT_VIRTUAL_DIFFUSE_INTENSITY	0.8
+
+//Retain every capture stored by an implementation
+#define RETAIN_ALL_CAPTURES			-1
+
+//Default memory budget (bytes) for retained captures, beyond which the oldest are spilled to disk
+#define DEFAULT_CAPTURE_MEMORY_BUDGET		(1024 * 1024 * 1024)
+
+//Default number of iterations that can be queued between the stages of a pipelined experiment run
+#define DEFAULT_PIPELINE_QUEUE_SIZE		2
+
+//Default number of patterns projected and captured together in a batched experiment run, 0 for all of them
+#define DEFAULT_BATCH_SIZE			0
+
+//Default number of background threads and memory budget (bytes) for writing pattern and capture images
+#define DEFAULT_IMAGE_WRITER_THREADS		2
+#define DEFAULT_IMAGE_WRITER_MEMORY_BUDGET	(256 * 1024 * 1024)
+
 using namespace std;
 using namespace cv;
 
@@ -80,6 +116,7 @@ using namespace cv;
 
 //Forward declaration
 class slExperiment;
+class slDepthExperimentResult;
 
 //Abstract class that defines a structured light implementation
 class slImplementation {
@@ -114,6 +151,9 @@ class slImplementation {
 		//Process a capture
 		virtual void processCapture(Mat) {};
 
+		//Get the number of most recent stored captures the implementation reads back, 0 for none or RETAIN_ALL_CAPTURES
+		virtual int getNumberCapturesRetained() {return RETAIN_ALL_CAPTURES;}
+
 		//Process after the interations
 		virtual void postIterationsProcess();
 		
@@ -229,7 +269,8 @@ class slInfrastructure {
 		): 
 			name(newName), 
 			infrastructureSetup(newInfrastructureSetup), 
-			experiment(NULL)
+			experiment(NULL),
+			undistortionIdentity(true)
 		{};
 
 		//Clean up
@@ -238,9 +279,15 @@ class slInfrastructure {
 		//Initialise the infrastucture
 		virtual void init();
 
+		//Clean up after an experiment has run
+		virtual void postExperimentRun() {};
+
 		//Project the structured light implementation pattern and capture it
 		virtual Mat projectAndCapture(Mat) = 0;
 
+		//Project and capture a batch of patterns from consecutive iterations starting at an iteration index, by default one after the other
+		virtual vector<Mat> projectAndCaptureBatch(const vector<Mat> &, int);
+
 		//Return the name of this infrastructure 
 		string getName();
 
@@ -265,6 +312,12 @@ class slInfrastructure {
 		//Get the distance between the camera and the projector
 		double getCameraProjectorSeparation();
 
+		//Build the undistortion maps once the calibration matrices are loaded
+		void initUndistortion();
+
+		//Undistort a capture using the calibration matrices
+		Mat undistortCapture(Mat);
+
 		//A reference to the current experiment
 		slExperiment *experiment;
 		
@@ -279,6 +332,19 @@ class slInfrastructure {
 		slInfrastructureSetup infrastructureSetup;
 
 	private:
+		//Build the undistortion maps for a given capture size
+		void initUndistortion(Size);
+
+		//Check if undistortion leaves captures unchanged, such as with no distortion calibration
+		bool undistortionIdentity;
+
+		//The capture size the undistortion maps were built for
+		Size undistortionSize;
+
+		//The fixed point undistortion maps
+		Mat undistortionMap1;
+		Mat undistortionMap2;
+
 		//Generate a unique identifier for this infrastructure and setup (for saving/reading calibration)
 		unsigned int getUniqueID();
 
@@ -309,20 +375,118 @@ class slBlenderVirtualInfrastructure : public slInfrastructure {
 				)
 			),
 			saveBlenderFile(false),
-			virtualSceneJSONFilename(string("slVirtualScene.json"))
+			virtualSceneJSONFilename(string("slVirtualScene.json")),
+			useRenderServer(true),
+			renderProcesses(DEFAULT_RENDER_PROCESSES)
 		{};
 
+		//Clean up
+		virtual ~slBlenderVirtualInfrastructure();
+
 		//Check if saving blender file
 		bool saveBlenderFile;
 
 		//The JSON filename that describes the objects in the virtual scene
 		string virtualSceneJSONFilename;
 
+		//Check if rendering with a persistent blender process that loads the scene once per experiment, instead of one blender process per pattern
+		bool useRenderServer;
+
+		//The number of blender processes rendering a batch of patterns concurrently
+		int renderProcesses;
+
 		//Initialise the infrastucture
 		void init();
 
+		//Clean up after an experiment has run
+		void postExperimentRun();
+
+		//Project the structured light implementation pattern and capture it
+		Mat projectAndCapture(Mat);
+
+		//Project and capture a batch of patterns, spread across concurrent blender processes
+		vector<Mat> projectAndCaptureBatch(const vector<Mat> &, int);
+
+	private:
+		//Start persistent blender processes for the current virtual scene until there are a number of them, and wait for them to connect
+		void startRenderServers(int);
+
+		//Ask the persistent blender processes to finish
+		void stopRenderServers();
+
+		//Ask a persistent blender process to finish
+		void stopRenderServer(int);
+
+		//Render the pattern of an iteration with a persistent blender process (or a single blender process if it is not running)
+		Mat renderPattern(int, int, Mat);
+
+		//Render a pattern file to a capture file with a single blender process
+		bool renderWithProcess(string, string, string);
+
+		//Render a pattern file to a capture file with a persistent blender process
+		bool renderWithServer(int, string, string, string);
+
+		//The sockets connected to the persistent blender processes, -1 once a process is lost
+		vector<int> renderServerSockets;
+};
+
+//Virtual infrastructure that ray traces the blender virtual scene directly, placing the camera and projector as slBlenderVirtualInfrastructure.py does
+class slNativeVirtualInfrastructure : public slInfrastructure {
+	public:
+		//Create a native virtual infrastruture instance
+		slNativeVirtualInfrastructure(
+			slInfrastructureSetup newInfrastructureSetup = slInfrastructureSetup()
+		): 
+			slInfrastructure(
+				string("slNativeVirtualInfrastructure"), 
+				slInfrastructureSetup(
+					newInfrastructureSetup.cameraDevice,
+					//Square projector, the same as the blender spot light projector
+					slProjectorDevice(
+						(int)newInfrastructureSetup.projectorDevice.resolution.width,
+						(int)newInfrastructureSetup.projectorDevice.resolution.width,
+						newInfrastructureSetup.projectorDevice.horizontalFOV,
+						newInfrastructureSetup.projectorDevice.horizontalFOV
+					),
+					newInfrastructureSetup.cameraProjectorSeparation
+				)
+			),
+			virtualSceneJSONFilename(string("slVirtualScene.json")),
+			projectorEnergy(DEFAULT_VIRTUAL_PROJECTOR_ENERGY),
+			projectorDistance(DEFAULT_VIRTUAL_PROJECTOR_DISTANCE),
+			diffuseIntensity(DEFAULT_VIRTUAL_DIFFUSE_INTENSITY)
+		{};
+
+		//The JSON filename that describes the objects in the virtual scene
+		string virtualSceneJSONFilename;
+
+		//The projector energy
+		double projectorEnergy;
+
+		//The distance at which the projector light falls to half of its energy (inverse square falloff)
+		double projectorDistance;
+
+		//The fraction of light the surfaces diffusely reflect
+		double diffuseIntensity;
+
+		//Initialise the infrastucture, the rendered camera has no distortion so there is no calibration
+		void init();
+
 		//Project the structured light implementation pattern and capture it
 		Mat projectAndCapture(Mat);
+
+		//Get the virtual scene
+		const slVirtualScene &getVirtualScene();
+
+		//Get the location of the camera
+		Vec3d getCameraLocation();
+
+		//Get the location of the projector
+		Vec3d getProjectorLocation();
+
+	private:
+		//The virtual scene loaded from the JSON file
+		slVirtualScene virtualScene;
 };
 
 //Physical infrastructure using opencv projection and video capture
@@ -367,8 +531,153 @@ class slExperimentResult {
 		virtual ~slExperimentResult() {};
 };
 
+//The ways an experiment can run its pattern generation, projection/capture and processing iterations
+enum slRunMode {
+	//Run each stage of each iteration one after the other
+	SL_RUN_SEQUENTIAL,
+
+	//Overlap the stages of consecutive iterations on separate threads, requires patterns that do not depend on captures
+	SL_RUN_PIPELINED,
+
+	//Generate a batch of patterns, project and capture them together (concurrently if the infrastructure can), then process the captures in order, requires patterns that do not depend on captures
+	SL_RUN_BATCHED
+};
+
+//A fixed capacity queue used to pass work between threads, push blocks while full and pop blocks while empty
+template <typename T>
+class slBoundedQueue {
+	public:
+		//Create a bounded queue
+		slBoundedQueue(size_t newCapacity): capacity(newCapacity > 0 ? newCapacity : 1), closed(false) {};
+
+		//Add an item, waiting for space, returns false if the queue has been closed
+		bool push(const T &item) {
+			unique_lock<mutex> lock(queueMutex);
+			notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+
+			if (closed) {
+				return false;
+			}
+
+			items.push_back(item);
+			notEmpty.notify_one();
+
+			return true;
+		};
+
+		//Remove the oldest item, waiting for one, returns false once the queue is closed and empty
+		bool pop(T &item) {
+			unique_lock<mutex> lock(queueMutex);
+			notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+
+			if (items.empty()) {
+				return false;
+			}
+
+			item = items.front();
+			items.pop_front();
+			notFull.notify_one();
+
+			return true;
+		};
+
+		//Close the queue, no more items can be added but remaining items can still be removed
+		void close() {
+			lock_guard<mutex> lock(queueMutex);
+			closed = true;
+			notFull.notify_all();
+			notEmpty.notify_all();
+		};
+
+	private:
+		//The maximum number of items
+		size_t capacity;
+
+		//Check if the queue has been closed
+		bool closed;
+
+		//The queued items
+		deque<T> items;
+
+		//Synchronisation
+		mutex queueMutex;
+		condition_variable notFull;
+		condition_variable notEmpty;
+};
+
+//Writes images on a pool of background threads so encoding and disk I/O stay off the acquisition path
+class slImageWriter {
+	public:
+		//Create an image writer with a number of threads and a budget (bytes) for images waiting to be written
+		slImageWriter(int newNumberThreads = DEFAULT_IMAGE_WRITER_THREADS, size_t newMemoryBudget = DEFAULT_IMAGE_WRITER_MEMORY_BUDGET);
+
+		//Clean up, waiting for queued images to be written
+		~slImageWriter();
+
+		//Queue an image to be written, waiting while the memory budget is used up. The image is shared, not copied, so must not be modified afterwards
+		void write(string, Mat);
+
+		//Wait for all queued images to be written, reporting and returning the number that could not be written
+		int flush();
+
+	private:
+		//An image waiting to be written
+		struct slImageWrite {
+			string filename;
+			Mat imageMat;
+		};
+
+		//Write queued images until stopped
+		void runWorker();
+
+		//The size of an image in bytes
+		static size_t getImageBytes(const Mat &);
+
+		//The memory budget for images waiting to be written
+		size_t memoryBudget;
+
+		//The bytes of images queued or being written
+		size_t pendingBytes;
+
+		//The number of images being written
+		int numberWriting;
+
+		//Check if the workers should stop
+		bool stopping;
+
+		//The images waiting to be written
+		deque<slImageWrite> queuedWrites;
+
+		//The images that could not be written since the last flush
+		vector<string> failedFilenames;
+
+		//The worker threads
+		vector<thread> workers;
+
+		//Synchronisation
+		mutex writerMutex;
+		condition_variable writeQueued;
+		condition_variable writeCompleted;
+};
+
+//Sets the iteration index seen by the current thread for as long as it is in scope, used by pipelined experiment stages
+class slIterationScope {
+	public:
+		//Set the iteration index of the current thread
+		slIterationScope(int);
+
+		//Restore the previous iteration index of the current thread
+		~slIterationScope();
+
+	private:
+		//The previous iteration index of the current thread
+		int previousIterationIndex;
+};
+
 //Abstract class that defines an experiment that tests a given implementation on a given infrastructure
 class slExperiment {
+	friend class slIterationScope;
+
 	public:
 		//Get the current session path
 		static string getSessionPath();
@@ -385,6 +694,21 @@ class slExperiment {
 		//Run this experiment
 		void run();
 
+		//Set how this experiment runs its iterations, and how many iterations can be queued between pipelined stages
+		void setRunMode(slRunMode, int newPipelineQueueSize = DEFAULT_PIPELINE_QUEUE_SIZE);
+
+		//Get how this experiment runs its iterations
+		slRunMode getRunMode();
+
+		//Set the number of patterns projected and captured together in a batched run, 0 for all of them
+		void setBatchSize(int);
+
+		//Set the number of background threads and the memory budget (bytes) used to write pattern and capture images
+		void setImageWriter(int, size_t);
+
+		//Set the memory budget (bytes, 0 for no budget) for retained captures, and if captures beyond it are spilled to disk
+		void setCaptureMemoryBudget(size_t, bool newSpillCaptures = true);
+
 		//Run before all iterations begin
 		virtual void runPreIterations() {};
 
@@ -424,6 +748,10 @@ class slExperiment {
 		//Store a result of this experiment
 		virtual void storeResult(slExperimentResult *) {};
 
+		//Store a batch of depth results of this experiment, such as a row. Implementations may call this
+		//concurrently for different rows, by default each result is passed to storeResult one call at a time
+		virtual void storeResults(const vector<slDepthExperimentResult> &);
+
 		//Get the current infrastructure
 		slInfrastructure *getInfrastructure();
 
@@ -442,7 +770,7 @@ class slExperiment {
 		//Get the last capture
 		Mat getLastCapture();
 
-		//Get the number of captures
+		//Get the number of captures stored, including those no longer retained
 		int getNumberCaptures();
 
 		//Compute the depth from a pair of x coordinates from the projection pattern and the image
@@ -460,17 +788,170 @@ class slExperiment {
 		slImplementation *implementation;
 
 	private:
+		//An iteration passed between the stages of a pipelined run
+		struct slPipelineItem {
+			int iterationIndex;
+			Mat patternMat;
+			Mat captureMat;
+		};
+
+		//Run the iterations one stage after the other
+		void runSequentialIterations(string, string);
+
+		//Run the iterations with pattern generation, projection/capture and processing overlapped on separate threads
+		void runPipelinedIterations(string, string);
+
+		//Generate the pattern of each iteration for a pipelined run
+		void runPipelinedPatternGeneration(string, slBoundedQueue<slPipelineItem> *);
+
+		//Process the capture of each iteration for a pipelined run
+		void runPipelinedCaptureProcessing(string, slBoundedQueue<slPipelineItem> *);
+
+		//Run the iterations by generating a batch of patterns, projecting and capturing them together, then processing the captures in order
+		void runBatchedIterations(string, string);
+
 		//The current session path
 		static string sessionPath;
 
+		//The iteration index seen by the current thread during a pipelined run, or -1
+		static thread_local int threadIterationIndex;
+
+		//How this experiment runs its iterations
+		slRunMode runMode;
+
+		//The number of iterations that can be queued between pipelined stages
+		int pipelineQueueSize;
+
+		//The number of patterns projected and captured together in a batched run, 0 for all of them
+		int batchSize;
+
+		//Serialises the run hooks during a pipelined run
+		mutex hookMutex;
+
+		//Serialises storeResult calls made by concurrent storeResults calls
+		mutex storeResultMutex;
+
+		//Writes the pattern and capture images during a run
+		slImageWriter *imageWriter;
+
+		//The number of background threads used to write images
+		int imageWriterThreads;
+
+		//The memory budget (bytes) for images waiting to be written
+		size_t imageWriterMemoryBudget;
+
 		//The current experiment path
 		string path;
 
 		//The current pattern generation and capture iteration index
 		int iterationIndex;
 
-		//The stored captures
-		vector<Mat> *captures;
+		//Drop the oldest retained capture, optionally spilling it to disk first
+		void discardOldestCapture(bool);
+
+		//The retained captures, oldest first
+		deque<Mat> *captures;
+
+		//The number of captures stored before the oldest retained capture
+		int numberCapturesDiscarded;
+
+		//The bytes used by the retained captures
+		size_t capturesBytes;
+
+		//The memory budget (bytes) for retained captures, 0 for no budget
+		size_t captureMemoryBudget;
+
+		//Check if captures beyond the memory budget are spilled to disk
+		bool spillCaptures;
+
+		//The files of captures spilled to disk by index
+		map<int, string> spilledCaptureFilenames;
+};
+
+//Dense row-major grid of depth values, one row per camera y and one column per pattern x, with a packed validity bitmap
+class slDepthGrid {
+	public:
+		//Create a depth grid
+		slDepthGrid(int newWidth = 0, int newHeight = 0) {
+			resize(newWidth, newHeight);
+		};
+
+		//Resize the grid, clearing all depth values
+		void resize(int, int);
+
+		//Clear all depth values
+		void clear();
+
+		//Get the width (number of pattern columns)
+		int getWidth() const {
+			return width;
+		};
+
+		//Get the height (number of camera rows)
+		int getHeight() const {
+			return height;
+		};
+
+		//Check if a location lies within the grid
+		bool contains(int x, int y) const {
+			return (unsigned int)x < (unsigned int)width && (unsigned int)y < (unsigned int)height;
+		};
+
+		//Check if depth value has been set
+		bool isValued(int x, int y) const {
+			return contains(x, y) && isValued(getValuedRow(y), x);
+		};
+
+		//Get depth value
+		double get(int x, int y) const {
+			return contains(x, y) ? getDepthRow(y)[x] : 0.0;
+		};
+
+		//Set depth value, locations outside of the grid are ignored
+		void set(int x, int y, double z) {
+			if (contains(x, y)) {
+				getDepthRow(y)[x] = z;
+				getValuedRow(y)[x >> 6] |= (uint64_t)1 << (x & 63);
+			}
+		};
+
+		//Get a row of depth values
+		double *getDepthRow(int y) {
+			return &depth[(size_t)y * width];
+		};
+		const double *getDepthRow(int y) const {
+			return &depth[(size_t)y * width];
+		};
+
+		//Get a row of the validity bitmap, each row starts on a new word so rows can be written independently
+		uint64_t *getValuedRow(int y) {
+			return &valued[(size_t)y * wordsPerRow];
+		};
+		const uint64_t *getValuedRow(int y) const {
+			return &valued[(size_t)y * wordsPerRow];
+		};
+
+		//Check if depth value has been set in a row of the validity bitmap
+		static bool isValued(const uint64_t *valuedRow, int x) {
+			return (valuedRow[x >> 6] >> (x & 63)) & 1;
+		};
+
+		//Count the number of values set in the first columns of a row
+		int countValued(int, int) const;
+
+	private:
+		//Grid dimensions
+		int width;
+		int height;
+
+		//Number of 64 bit words per validity bitmap row
+		int wordsPerRow;
+
+		//The depth data
+		vector<double> depth;
+
+		//The validity bitmap
+		vector<uint64_t> valued;
 };
 
 //Class that defines a kind of experiment that records depth
@@ -485,28 +966,28 @@ class slDepthExperiment : public virtual slExperiment {
 		//Store a result of this experiment
 		virtual void storeResult(slExperimentResult *);
 
-		//Get the number of depth data values
-		//int getNumDepthDataValues();
+		//Store a batch of depth results of this experiment directly into the depth grid, which is safe
+		//to call concurrently for different rows as each row is stored in its own part of the grid
+		virtual void storeResults(const vector<slDepthExperimentResult> &);
 
 		//Check if depth data value has been set
-		//bool isDepthDataValued(int);
-		bool isDepthDataValued(int, int);
+		bool isDepthDataValued(int x, int y) {
+			return depthGrid.isValued(x, y);
+		};
 
 		//Get depth data value
-		//double getDepthData(int);
-		double getDepthData(int, int);
+		double getDepthData(int x, int y) {
+			return depthGrid.get(x, y);
+		};
+
+		//Get the depth data grid
+		const slDepthGrid &getDepthGrid() {
+			return depthGrid;
+		};
 		
 	private:
-		//Number of depth data values
-		//int numDepthDataValues;
-
-		//Check if the depth data value has been set
-		//bool *depthDataValued;
-		map<int, map<int, bool> > depthDataValued;
-
 		//The depth data
-		//double *depthData;
-		map<int, map<int, double> > depthData;
+		slDepthGrid depthGrid;
 };
 
 //Class that defines a depth experiment result with x, y and z coordinates
@@ -531,6 +1012,9 @@ class slSpeedExperiment : public virtual slExperiment {
 		//Create a speed experiment
 		slSpeedExperiment(slInfrastructure *, slImplementation *);
 
+		//Run before all iterations begin
+		virtual void runPreIterations();
+
 		//Run before a pattern is generated
 		virtual void runPrePatternGeneration();
 
@@ -543,27 +1027,36 @@ class slSpeedExperiment : public virtual slExperiment {
 		//Run after pattern is projected and captured
 		virtual void runPostProjectAndCapture();
 
-		//Run before the implementation processes this iteration
-		virtual void runPreIterationProcess();
+		//Run before the implementation processes a capture
+		virtual void runPreProcessCapture();
 
-		//Run after the implementation processes this iteration
-		virtual void runPostIterationProcess();
+		//Run after the implementation processes a capture
+		virtual void runPostProcessCapture();
 
 		//Run before the implementation processes after all the iterations
-		virtual void runPrePostIterationsProcess();
+		virtual void runPreImplementationPostIterationsProcess();
 
 		//Run after the implementation processes after all the iterations
-		virtual void runPostPostIterationsProcess();
+		virtual void runPostImplementationPostIterationsProcess();
 
-		//Get the total clock value
-		clock_t getTotalClock();
+		//Get the total wall time taken, in seconds
+		double getTotalSeconds();
 
 	private:
-		//The previous stored clock
-		clock_t previousClock;
+		//Start timing a stage of a sequential run
+		void startStage();
+
+		//Add the time since the stage started to the total, for a sequential run
+		void endStage();
+
+		//When the current stage of a sequential run started
+		chrono::steady_clock::time_point stageStart;
+
+		//When the iterations of the current run started
+		chrono::steady_clock::time_point runStart;
 
-		//Total clock taken to run this experiment
-		long totalClock;
+		//Total wall time taken to run this experiment
+		chrono::steady_clock::duration totalTime;
 };
 
 //Class that defines a kind of experiment that records the speed of processing and depth
@@ -3,6 +3,7 @@ import math
 import sys
 import os
 import json
+import socket
 
 
 def getTuple(json, angle = False, default = 0):
@@ -20,21 +21,7 @@ def getNumber(json):
 	
 	return json
 
-if __name__ == "__main__":
-	argv = sys.argv
-	argv = argv[argv.index("--") + 1:] 
-
-	patternPath = os.path.abspath(argv[0])
-	capturePath = os.path.abspath(argv[1])
-	outputPath = os.path.abspath(argv[2])
-	cameraWidth = int(argv[3])
-	cameraHeight = int(argv[4])
-	cameraHorizontalFOV = float(argv[5])
-	projectorHorizontalFOV = float(argv[6])
-	halfCameraProjectorSeparation = float(argv[7]) / 2.0
-	saveBlenderFile = (argv[8] == "true")
-	virtualSceneJSONPath = os.path.abspath(argv[9])
-
+def buildScene(cameraWidth, cameraHeight, cameraHorizontalFOV, projectorHorizontalFOV, halfCameraProjectorSeparation, virtualSceneJSONPath):
 	jsonData = json.loads(open(virtualSceneJSONPath).read())
 
 	bpy.ops.scene.new(type='EMPTY')
@@ -84,9 +71,7 @@ if __name__ == "__main__":
 	projector.spot_blend = 0
 	projector.shadow_buffer_clip_end = 1000
 
-	image = bpy.data.images.load(patternPath)
 	texture = bpy.data.textures.new('ColorTex', type = 'IMAGE')
-	texture.image = image   
 	texture.extension = 'CLIP' 
 	projector.active_texture = texture
 	projector.texture_slots[0].texture_coords = 'VIEW'
@@ -111,11 +96,76 @@ if __name__ == "__main__":
 	bpy.context.scene.render.resolution_y = cameraHeight
 	bpy.context.scene.render.resolution_percentage = 100
 
+	return texture
+
+def renderPattern(texture, patternPath, capturePath, outputPath, saveBlenderFile):
+	previousImage = texture.image
+
+	texture.image = bpy.data.images.load(patternPath)
+
+	if previousImage != None:
+		bpy.data.images.remove(previousImage)
+
 	bpy.context.scene.render.filepath = capturePath
 
 	if saveBlenderFile:
-		bpy.ops.wm.save_as_mainfile(filepath=outputPath)
+		bpy.ops.wm.save_as_mainfile(filepath=outputPath, copy=True)
 
 	bpy.ops.render.render( write_still=True ) 
 
+# Keep the scene loaded and render each pattern requested over a local socket, one tab separated request per line:
+#   render <patternPath> <capturePath> <outputPath> <saveBlenderFile>
+# answered with "done" or "error <message>", until "quit" or the connection closes
+def runServer(texture, port):
+	bpy.context.scene.render.image_settings.compression = 0
+
+	connection = socket.create_connection(('127.0.0.1', port))
+	requests = connection.makefile('r')
+
+	for request in requests:
+		fields = request.rstrip('\n').split('\t')
+
+		if fields[0] == "quit":
+			break
+
+		try:
+			if fields[0] != "render" or len(fields) != 5:
+				raise ValueError("invalid request: " + request)
+
+			renderPattern(texture, os.path.abspath(fields[1]), os.path.abspath(fields[2]), os.path.abspath(fields[3]), fields[4] == "true")
+			connection.sendall(b"done\n")
+		except Exception as exception:
+			connection.sendall(("error " + str(exception).replace('\n', ' ') + "\n").encode())
+
+	connection.close()
+
+if __name__ == "__main__":
+	argv = sys.argv
+	argv = argv[argv.index("--") + 1:] 
+
+	if argv[0] == "--server":
+		port = int(argv[1])
+		cameraWidth = int(argv[2])
+		cameraHeight = int(argv[3])
+		cameraHorizontalFOV = float(argv[4])
+		projectorHorizontalFOV = float(argv[5])
+		halfCameraProjectorSeparation = float(argv[6]) / 2.0
+		virtualSceneJSONPath = os.path.abspath(argv[7])
+
+		texture = buildScene(cameraWidth, cameraHeight, cameraHorizontalFOV, projectorHorizontalFOV, halfCameraProjectorSeparation, virtualSceneJSONPath)
+		runServer(texture, port)
+	else:
+		patternPath = os.path.abspath(argv[0])
+		capturePath = os.path.abspath(argv[1])
+		outputPath = os.path.abspath(argv[2])
+		cameraWidth = int(argv[3])
+		cameraHeight = int(argv[4])
+		cameraHorizontalFOV = float(argv[5])
+		projectorHorizontalFOV = float(argv[6])
+		halfCameraProjectorSeparation = float(argv[7]) / 2.0
+		saveBlenderFile = (argv[8] == "true")
+		virtualSceneJSONPath = os.path.abspath(argv[9])
+
+		texture = buildScene(cameraWidth, cameraHeight, cameraHorizontalFOV, projectorHorizontalFOV, halfCameraProjectorSeparation, virtualSceneJSONPath)
+		renderPattern(texture, patternPath, capturePath, outputPath, saveBlenderFile)
 	
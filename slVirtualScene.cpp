@@ -0,0 +1,288 @@
+/*
+ * File: slVirtualScene.cpp
+ *
+ * Copyright 2016 Evan Dekker
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *
+ * This file implements classes slVirtualSceneObject and slVirtualScene.
+ */
+#include "slVirtualScene.h"
+
+//Ignore intersections closer than this to the ray origin
+#define VIRTUAL_SCENE_MIN_DISTANCE	1e-9
+
+//Read a 3 vector from a JSON array, or a default for each component if not present
+static Vec3d readVec3d(const FileNode &node, double defaultValue) {
+	Vec3d value(defaultValue, defaultValue, defaultValue);
+
+	if (node.isSeq() && node.size() == 3) {
+		for (int index = 0; index < 3; index++) {
+			value[index] = (double)node[index];
+		}
+	}
+
+	return value;
+}
+
+/*
+ * slVirtualSceneObject
+ */
+
+//Create a virtual scene object with a type, a location, a rotation (XYZ euler angles in degrees, as used by blender) and a scale
+slVirtualSceneObject::slVirtualSceneObject(slVirtualSceneObjectType newType, Vec3d newLocation, Vec3d rotation, Vec3d scale) : type(newType), location(newLocation) {
+	double cx = cos(rotation[0] * CV_PI / 180.0), sx = sin(rotation[0] * CV_PI / 180.0);
+	double cy = cos(rotation[1] * CV_PI / 180.0), sy = sin(rotation[1] * CV_PI / 180.0);
+	double cz = cos(rotation[2] * CV_PI / 180.0), sz = sin(rotation[2] * CV_PI / 180.0);
+
+	//Blender XYZ euler rotation, R = Rz * Ry * Rx
+	double r[9] = {
+		cz * cy,	cz * sy * sx - sz * cx,	cz * sy * cx + sz * sx,
+		sz * cy,	sz * sy * sx + cz * cx,	sz * sy * cx - cz * sx,
+		-sy,		cy * sx,		cy * cx
+	};
+
+	//A flat (zero) scale cannot be inverted, keep it just above zero
+	for (int axis = 0; axis < 3; axis++) {
+		if (fabs(scale[axis]) < VIRTUAL_SCENE_MIN_DISTANCE) {
+			scale[axis] = VIRTUAL_SCENE_MIN_DISTANCE;
+		}
+	}
+
+	//The object transform is R * S, so world to local is S^-1 * R^T and local normals to world are R * S^-1
+	for (int row = 0; row < 3; row++) {
+		for (int column = 0; column < 3; column++) {
+			worldToLocal[(row * 3) + column] = r[(column * 3) + row] / scale[row];
+			normalToWorld[(row * 3) + column] = r[(row * 3) + column] / scale[column];
+		}
+	}
+}
+
+//Transform a world vector by one of the 3x3 row major matrices
+Vec3d slVirtualSceneObject::transform(const double *matrix, const Vec3d &vector) {
+	return Vec3d(
+		(matrix[0] * vector[0]) + (matrix[1] * vector[1]) + (matrix[2] * vector[2]),
+		(matrix[3] * vector[0]) + (matrix[4] * vector[1]) + (matrix[5] * vector[2]),
+		(matrix[6] * vector[0]) + (matrix[7] * vector[1]) + (matrix[8] * vector[2])
+	);
+}
+
+//Intersect a ray (origin and direction) with this object closer than a distance, and fill in the hit if found
+bool slVirtualSceneObject::intersect(const Vec3d &origin, const Vec3d &direction, double maxDistance, slVirtualSceneHit *hit) const {
+	//Intersect in the object's local space, where the ray distance is unchanged
+	Vec3d localOrigin = transform(worldToLocal, origin - location);
+	Vec3d localDirection = transform(worldToLocal, direction);
+
+	double distance = -1.0;
+	Vec3d localNormal;
+
+	switch (type) {
+		case SL_VIRTUAL_PLANE: {
+			if (localDirection[2] == 0.0) {
+				return false;
+			}
+
+			distance = -localOrigin[2] / localDirection[2];
+
+			double x = localOrigin[0] + (distance * localDirection[0]);
+			double y = localOrigin[1] + (distance * localDirection[1]);
+
+			if (fabs(x) > 1.0 || fabs(y) > 1.0) {
+				return false;
+			}
+
+			localNormal = Vec3d(0.0, 0.0, 1.0);
+			break;
+		}
+
+		case SL_VIRTUAL_SPHERE: {
+			double a = localDirection.dot(localDirection);
+			double b = localOrigin.dot(localDirection);
+			double c = localOrigin.dot(localOrigin) - 1.0;
+			double discriminant = (b * b) - (a * c);
+
+			if (a == 0.0 || discriminant < 0.0) {
+				return false;
+			}
+
+			double root = sqrt(discriminant);
+
+			distance = (-b - root) / a;
+
+			//Inside the sphere, use the far side
+			if (distance <= VIRTUAL_SCENE_MIN_DISTANCE) {
+				distance = (-b + root) / a;
+			}
+
+			localNormal = localOrigin + (localDirection * distance);
+			break;
+		}
+
+		case SL_VIRTUAL_CUBE: {
+			double nearDistance = -DBL_MAX;
+			double farDistance = DBL_MAX;
+			int nearAxis = 0;
+			int farAxis = 0;
+
+			//Slab test on each axis
+			for (int axis = 0; axis < 3; axis++) {
+				if (localDirection[axis] == 0.0) {
+					if (fabs(localOrigin[axis]) > 1.0) {
+						return false;
+					}
+
+					continue;
+				}
+
+				double first = (-1.0 - localOrigin[axis]) / localDirection[axis];
+				double second = (1.0 - localOrigin[axis]) / localDirection[axis];
+
+				if (first > second) {
+					swap(first, second);
+				}
+
+				if (first > nearDistance) {
+					nearDistance = first;
+					nearAxis = axis;
+				}
+
+				if (second < farDistance) {
+					farDistance = second;
+					farAxis = axis;
+				}
+			}
+
+			if (nearDistance > farDistance) {
+				return false;
+			}
+
+			int axis = nearAxis;
+			distance = nearDistance;
+
+			//Inside the cube, use the far side
+			if (distance <= VIRTUAL_SCENE_MIN_DISTANCE) {
+				axis = farAxis;
+				distance = farDistance;
+			}
+
+			localNormal = Vec3d(0.0, 0.0, 0.0);
+			localNormal[axis] = (localOrigin[axis] + (distance * localDirection[axis])) < 0.0 ? -1.0 : 1.0;
+			break;
+		}
+	}
+
+	if (distance <= VIRTUAL_SCENE_MIN_DISTANCE || distance >= maxDistance) {
+		return false;
+	}
+
+	if (hit != NULL) {
+		Vec3d normal = transform(normalToWorld, localNormal);
+
+		hit->distance = distance;
+		hit->location = origin + (direction * distance);
+		hit->normal = normal * (1.0 / norm(normal));
+	}
+
+	return true;
+}
+
+/*
+ * slVirtualScene
+ */
+
+//Load the objects of a virtual scene JSON file, replacing any current objects
+bool slVirtualScene::load(string filename) {
+	clear();
+
+	FileStorage fileStorage(filename, FileStorage::READ | FileStorage::FORMAT_JSON);
+
+	if (!fileStorage.isOpened()) {
+		return false;
+	}
+
+	FileNode objectsNode = fileStorage["objects"];
+
+	for (FileNodeIterator objectNode = objectsNode.begin(); objectNode != objectsNode.end(); ++objectNode) {
+		string typeName = (string)(*objectNode)["type"];
+		slVirtualSceneObjectType objectType;
+
+		if (typeName == "plane") {
+			objectType = SL_VIRTUAL_PLANE;
+		} else if (typeName == "sphere") {
+			objectType = SL_VIRTUAL_SPHERE;
+		} else if (typeName == "cube") {
+			objectType = SL_VIRTUAL_CUBE;
+		} else {
+			cerr << "WARNING: skipping virtual scene object of unknown type '" << typeName << "' in " << filename << endl;
+			continue;
+		}
+
+		addObject(slVirtualSceneObject(
+			objectType,
+			readVec3d((*objectNode)["location"], 0.0),
+			readVec3d((*objectNode)["rotation"], 0.0),
+			readVec3d((*objectNode)["scale"], 1.0)
+		));
+	}
+
+	fileStorage.release();
+
+	return true;
+}
+
+//Add an object to the scene
+void slVirtualScene::addObject(slVirtualSceneObject object) {
+	objects.push_back(object);
+}
+
+//Remove all the objects
+void slVirtualScene::clear() {
+	objects.clear();
+}
+
+//Get the number of objects
+int slVirtualScene::getNumberObjects() const {
+	return (int)objects.size();
+}
+
+//Find the nearest intersection of a ray (origin and direction) closer than a distance
+bool slVirtualScene::intersect(const Vec3d &origin, const Vec3d &direction, double maxDistance, slVirtualSceneHit *hit) const {
+	bool found = false;
+	slVirtualSceneHit objectHit;
+
+	for (vector<slVirtualSceneObject>::const_iterator object = objects.begin(); object != objects.end(); ++object) {
+		if (object->intersect(origin, direction, maxDistance, &objectHit)) {
+			found = true;
+			maxDistance = objectHit.distance;
+
+			if (hit != NULL) {
+				*hit = objectHit;
+			}
+		}
+	}
+
+	return found;
+}
+
+//Check if any object intersects a ray (origin and direction) closer than a distance
+bool slVirtualScene::occluded(const Vec3d &origin, const Vec3d &direction, double maxDistance) const {
+	for (vector<slVirtualSceneObject>::const_iterator object = objects.begin(); object != objects.end(); ++object) {
+		if (object->intersect(origin, direction, maxDistance, NULL)) {
+			return true;
+		}
+	}
+
+	return false;
+}
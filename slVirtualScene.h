@@ -0,0 +1,116 @@
+/*
+ * File: slVirtualScene.h
+ *
+ * Copyright 2016 Evan Dekker
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *
+ * This file defines classes slVirtualSceneObject and slVirtualScene.
+ * A virtual scene is read from the same JSON files used by
+ * slBlenderVirtualInfrastructure.py (objects of type plane, sphere or
+ * cube with a location, rotation and scale), and can be intersected
+ * with rays to render it or to find its true depth.
+ */
+#ifndef SLVIRTUALSCENE_H
+#define SLVIRTUALSCENE_H
+
+#include <string>
+#include <vector>
+#include <cfloat>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+//The types of object a virtual scene can contain, matching the blender primitives
+enum slVirtualSceneObjectType {
+	//A 2x2 square in the local XY plane
+	SL_VIRTUAL_PLANE,
+
+	//A sphere of radius 1
+	SL_VIRTUAL_SPHERE,
+
+	//A cube from -1 to 1 along each local axis
+	SL_VIRTUAL_CUBE
+};
+
+//The nearest intersection of a ray with a virtual scene
+struct slVirtualSceneHit {
+	//The ray distance, in multiples of the ray direction
+	double distance;
+
+	//The intersection location
+	Vec3d location;
+
+	//The unit surface normal at the intersection
+	Vec3d normal;
+};
+
+//An object within a virtual scene
+class slVirtualSceneObject {
+	public:
+		//Create a virtual scene object with a type, a location, a rotation (XYZ euler angles in degrees, as used by blender) and a scale
+		slVirtualSceneObject(slVirtualSceneObjectType, Vec3d, Vec3d, Vec3d);
+
+		//Intersect a ray (origin and direction) with this object closer than a distance, and fill in the hit if found
+		bool intersect(const Vec3d &, const Vec3d &, double, slVirtualSceneHit *) const;
+
+	private:
+		//Transform a world vector by one of the 3x3 row major matrices
+		static Vec3d transform(const double *, const Vec3d &);
+
+		//The object type
+		slVirtualSceneObjectType type;
+
+		//The object location
+		Vec3d location;
+
+		//Transforms world directions into the object's local space
+		double worldToLocal[9];
+
+		//Transforms local normals into world space
+		double normalToWorld[9];
+};
+
+//A virtual scene made of planes, spheres and cubes
+class slVirtualScene {
+	public:
+		//Create an empty virtual scene
+		slVirtualScene() {};
+
+		//Load the objects of a virtual scene JSON file, replacing any current objects
+		bool load(string);
+
+		//Add an object to the scene
+		void addObject(slVirtualSceneObject);
+
+		//Remove all the objects
+		void clear();
+
+		//Get the number of objects
+		int getNumberObjects() const;
+
+		//Find the nearest intersection of a ray (origin and direction) closer than a distance
+		bool intersect(const Vec3d &, const Vec3d &, double, slVirtualSceneHit *) const;
+
+		//Check if any object intersects a ray (origin and direction) closer than a distance
+		bool occluded(const Vec3d &, const Vec3d &, double) const;
+
+	private:
+		//The objects in the scene
+		vector<slVirtualSceneObject> objects;
+};
+
+#endif //SLVIRTUALSCENE_H